@@ -0,0 +1,265 @@
+#ifndef SIK_ZAD2_BOARD_H
+#define SIK_ZAD2_BOARD_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ByteStream.h"
+#include "MessageUtils.h"
+
+/**
+ * Set of positions (used for blocks) on a board of any size up to
+ * 65536 x 65536. The board is divided into 64 x 64 tiles, every tile is
+ * a bitmap with one 64-bit word per column. Tiles are allocated on the first
+ * insert and freed when they become empty, so an empty area costs nothing
+ * and memory scales with the populated part of the board, not its size.
+ * The last used tile is remembered, since lookups (explosion rays, moves)
+ * usually stay in the same tile - but only by lookups through a non-const
+ * Board, a const one is never written to (so it can be read from many
+ * threads at once).
+ * A set refilled every turn (explosions) is emptied with reset(), which
+ * zeroes the tiles instead of freeing them.
+ */
+class Board {
+ private:
+  static const uint16_t tile_shift = 6;
+  static const uint16_t tile_size = 1 << tile_shift;
+  static const uint16_t tile_mask = tile_size - 1;
+  // tile coordinates have 10 bits each, key = tile_x << key_shift | tile_y
+  static const uint32_t key_shift = 16 - tile_shift;
+
+  struct Tile {
+    std::array<uint64_t, tile_size> columns{};
+    uint16_t count{};
+  };
+
+  std::unordered_map<uint32_t, std::unique_ptr<Tile>> tiles;
+  size_t count{};
+
+  uint32_t cached_key = UINT32_MAX;
+  Tile *cached_tile{};
+
+  static uint32_t key_of(Position pos) {
+    return (uint32_t)(pos.x >> tile_shift) << key_shift |
+           (uint32_t)(pos.y >> tile_shift);
+  }
+
+  static uint64_t bit_of(Position pos) {
+    return (uint64_t)1 << (pos.y & tile_mask);
+  }
+
+  [[nodiscard]] const Tile *find_tile(uint32_t key) const {
+    auto it = tiles.find(key);
+    return it == tiles.end() ? nullptr : it->second.get();
+  }
+
+  Tile *find_tile(uint32_t key) {
+    if (key != cached_key) {
+      auto it = tiles.find(key);
+      if (it == tiles.end()) {
+        return nullptr;
+      }
+      cached_key = key;
+      cached_tile = it->second.get();
+    }
+    return cached_tile;
+  }
+
+ public:
+  Board() = default;
+
+  Board(const Board &other) : count(other.count) {
+    for (auto &[key, tile] : other.tiles) {
+      tiles.emplace(key, std::make_unique<Tile>(*tile));
+    }
+  }
+
+  Board &operator=(const Board &other) {
+    if (this != &other) {
+      Board copy(other);
+      swap(copy);
+    }
+    return *this;
+  }
+
+  Board(Board &&other) noexcept {
+    swap(other);
+  }
+
+  Board &operator=(Board &&other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  void swap(Board &other) noexcept {
+    tiles.swap(other.tiles);
+    std::swap(count, other.count);
+    cached_key = other.cached_key = UINT32_MAX;
+  }
+
+  [[nodiscard]] bool contains(Position pos) const {
+    const Tile *tile = find_tile(key_of(pos));
+    return tile && (tile->columns[pos.x & tile_mask] & bit_of(pos));
+  }
+
+  [[nodiscard]] bool contains(Position pos) {
+    Tile *tile = find_tile(key_of(pos));
+    return tile && (tile->columns[pos.x & tile_mask] & bit_of(pos));
+  }
+
+  /**
+   * Returns false if the position was already there.
+   */
+  bool insert(Position pos) {
+    uint32_t key = key_of(pos);
+    Tile *tile = find_tile(key);
+    if (!tile) {
+      tile = tiles.emplace(key, std::make_unique<Tile>()).first->second.get();
+      cached_key = key;
+      cached_tile = tile;
+    }
+
+    uint64_t &column = tile->columns[pos.x & tile_mask];
+    if (column & bit_of(pos)) {
+      return false;
+    }
+    column |= bit_of(pos);
+    tile->count++;
+    count++;
+    return true;
+  }
+
+  /**
+   * Returns false if there was no such position.
+   */
+  bool erase(Position pos) {
+    uint32_t key = key_of(pos);
+    Tile *tile = find_tile(key);
+    if (!tile || !(tile->columns[pos.x & tile_mask] & bit_of(pos))) {
+      return false;
+    }
+
+    tile->columns[pos.x & tile_mask] &= ~bit_of(pos);
+    count--;
+    if (--tile->count == 0) {
+      tiles.erase(key);
+      cached_key = UINT32_MAX;
+    }
+    return true;
+  }
+
+  [[nodiscard]] size_t size() const {
+    return count;
+  }
+
+  [[nodiscard]] bool empty() const {
+    return count == 0;
+  }
+
+  [[nodiscard]] size_t allocated_tiles() const {
+    return tiles.size();
+  }
+
+  void clear() {
+    tiles.clear();
+    count = 0;
+    cached_key = UINT32_MAX;
+  }
+
+  /**
+   * Removes every position but keeps the tiles (zeroed), so refilling
+   * the same area doesn't allocate. Costs a memset per tile ever used.
+   */
+  void reset() {
+    for (auto &[key, tile] : tiles) {
+      if (tile->count != 0) {
+        tile->columns.fill(0);
+        tile->count = 0;
+      }
+    }
+    count = 0;
+  }
+
+  /**
+   * Calls f on every position, in the same order as std::set<Position>
+   * would (by x, then by y). Tiles are grouped into columns of tiles,
+   * then every x of such column is visited in all of them, bottom-up.
+   */
+  template <typename F>
+  void for_each(F f) const {
+    std::vector<std::pair<uint32_t, const Tile *>> sorted;
+    sorted.reserve(tiles.size());
+    for (auto &[key, tile] : tiles) {
+      if (tile->count != 0) {
+        sorted.emplace_back(key, tile.get());
+      }
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    size_t group_begin = 0;
+    while (group_begin < sorted.size()) {
+      uint32_t tile_x = sorted[group_begin].first >> key_shift;
+      size_t group_end = group_begin;
+      while (group_end < sorted.size() &&
+             sorted[group_end].first >> key_shift == tile_x) {
+        group_end++;
+      }
+
+      for (uint16_t dx = 0; dx < tile_size; ++dx) {
+        auto x = (uint16_t)(tile_x << tile_shift | dx);
+        for (size_t i = group_begin; i < group_end; ++i) {
+          auto tile_y = (uint16_t)(sorted[i].first & ((1 << key_shift) - 1));
+          uint64_t column = sorted[i].second->columns[dx];
+          while (column) {
+            auto dy = (uint16_t)std::countr_zero(column);
+            column &= column - 1;
+            f(Position(x, (uint16_t)(tile_y << tile_shift | dy)));
+          }
+        }
+      }
+      group_begin = group_end;
+    }
+  }
+
+  /**
+   * Serialized exactly like std::set<Position> (a list of positions,
+   * delta-encoded in compact mode).
+   */
+  friend ByteStream &operator<<(ByteStream &os, const Board &board) {
+    os << (uint32_t)board.size();
+    if (os.is_compact()) {
+      Position prev;
+      board.for_each([&](Position pos) {
+        pos.write_after(os, prev);
+        prev = pos;
+      });
+    } else {
+      board.for_each([&](Position pos) { os << pos; });
+    }
+    return os;
+  }
+
+  friend ByteStream &operator>>(ByteStream &os, Board &board) {
+    uint32_t len = os.read_length();
+    board.clear();
+    Position pos;
+    for (size_t i = 0; i < len; ++i) {
+      if (os.is_compact()) {
+        Position prev = pos;
+        pos.read_after(os, prev);
+      } else {
+        os >> pos;
+      }
+      board.insert(pos);
+    }
+    return os;
+  }
+};
+
+#endif  // SIK_ZAD2_BOARD_H
@@ -1,10 +1,19 @@
 #ifndef SIK_ZAD3_BUFFER_H
 #define SIK_ZAD3_BUFFER_H
 
+#include <netinet/in.h>
+
 #include <boost/asio.hpp>
+#include <cstring>
+#include <iostream>
+#include <string>
 #include <utility>
 #include <vector>
 
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
 #include "ConnectionUtils.h"
 
 using boost::asio::ip::resolver_base;
@@ -30,7 +39,13 @@ class MessageTooShortException : public BufferException {
 
 class MessageTooLongException : public BufferException {
   [[nodiscard]] const char* what() const noexcept override {
-    return "deserialize expected more";
+    return "message longer than expected or allowed";
+  }
+};
+
+class InvalidNumberException : public BufferException {
+  [[nodiscard]] const char* what() const noexcept override {
+    return "varint doesn't fit its type";
   }
 };
 
@@ -64,20 +79,60 @@ class StreamBuffer {
   virtual void get() = 0;  // for udp only - reads a full message
   virtual void write_n_bytes(uint8_t n, std::vector<uint8_t> buff) = 0;
 
+  /**
+   * Bulk versions of the above for whole blocks of bytes (e.g. frames).
+   * By default done in max_single_datatype_size pieces.
+   */
+  virtual void read_bytes(uint8_t* dst, size_t n) {
+    std::vector<uint8_t> piece(max_single_datatype_size);
+    for (size_t offset = 0; offset < n; offset += max_single_datatype_size - 1) {
+      auto len = (uint8_t)std::min<size_t>(max_single_datatype_size - 1,
+                                           n - offset);
+      get_n_bytes(len, piece);
+      memcpy(dst + offset, piece.data(), len);
+    }
+  }
+
+  virtual void write_bytes(const uint8_t* src, size_t n) {
+    std::vector<uint8_t> piece(max_single_datatype_size);
+    for (size_t offset = 0; offset < n; offset += max_single_datatype_size - 1) {
+      auto len = (uint8_t)std::min<size_t>(max_single_datatype_size - 1,
+                                           n - offset);
+      memcpy(piece.data(), src + offset, len);
+      write_n_bytes(len, piece);
+    }
+  }
+
+  /**
+   * Marks the end of a message written since the last end_message() or
+   * send() - only matters for buffers that frame messages.
+   */
+  virtual void end_message() {
+  }
+
   virtual ~StreamBuffer() = default;
 };
 
-class TcpStreamBuffer : public StreamBuffer {
+/**
+ * Buffer of a stream socket - tcp, unix domain or any of them
+ * (StreamSocket, which is what connections are kept as).
+ * While held, what is sent is kept instead of written, so that someone else
+ * can write it (e.g. together with other sockets' in one syscall).
+ */
+template <typename Socket>
+class SocketStreamBuffer : public StreamBuffer {
  private:
-  std::shared_ptr<boost::asio::ip::tcp::socket> sock;
+  std::shared_ptr<Socket> sock;
   std::vector<uint8_t> internal_buffer;
   size_t bytes_to_send_count{};
+  bool holding = false;
+  std::vector<uint8_t> held;
 
  public:
-  explicit TcpStreamBuffer(std::shared_ptr<boost::asio::ip::tcp::socket> sock)
+  explicit SocketStreamBuffer(std::shared_ptr<Socket> sock)
       : sock(std::move(sock)), internal_buffer(max_single_datatype_size){};
 
-  explicit TcpStreamBuffer() : internal_buffer(max_single_datatype_size){};
+  explicit SocketStreamBuffer() : internal_buffer(max_single_datatype_size){};
 
   void get_n_bytes(uint8_t n, std::vector<uint8_t>& data) override {
     try {
@@ -89,11 +144,32 @@ class TcpStreamBuffer : public StreamBuffer {
 
   void send() override {
     if (bytes_to_send_count != 0) {
-      sock->send(boost::asio::buffer(internal_buffer, bytes_to_send_count));
+      if (holding) {
+        held.insert(held.end(), internal_buffer.begin(),
+                    internal_buffer.begin() + (ptrdiff_t)bytes_to_send_count);
+      } else {
+        sock->send(boost::asio::buffer(internal_buffer, bytes_to_send_count));
+      }
       bytes_to_send_count = 0;
     }
   }
 
+  void hold() {
+    holding = true;
+  }
+
+  [[nodiscard]] const std::vector<uint8_t>& get_held() const {
+    return held;
+  }
+
+  /**
+   * Stops holding, what was held is dropped (the holder has written it).
+   */
+  void release_held() {
+    holding = false;
+    held.clear();
+  }
+
   void end_receive() override {
   }
 
@@ -111,39 +187,126 @@ class TcpStreamBuffer : public StreamBuffer {
     bytes_to_send_count += n;
   }
 
-  ~TcpStreamBuffer() override = default;
+  void read_bytes(uint8_t* dst, size_t n) override {
+    try {
+      boost::asio::read(*sock, boost::asio::buffer(dst, n));
+    } catch (...) {
+      throw ConnectionAborted();
+    }
+  }
+
+  void write_bytes(const uint8_t* src, size_t n) override {
+    send();
+    if (holding) {
+      held.insert(held.end(), src, src + n);
+    } else {
+      boost::asio::write(*sock, boost::asio::buffer(src, n));
+    }
+  }
+
+  ~SocketStreamBuffer() override = default;
 };
 
+using StreamSocket = boost::asio::generic::stream_protocol::socket;
+using TcpStreamBuffer = SocketStreamBuffer<tcp::socket>;
+using UnixStreamBuffer =
+    SocketStreamBuffer<boost::asio::local::stream_protocol::socket>;
+using StreamSocketBuffer = SocketStreamBuffer<StreamSocket>;
+
 /**
- * I need to create two sockets here - one that I can connect, for sending
- * ( so when I send and the receiver is not receiving, I can get the info )
- * And another for receiving, since I should be prepared to receive
- * messages from any possible address.
- * Connecting UDP socket is handd because it takes care of ICMP
- * unreachable messages and can detect problems with GUI.
+ * Messages to GUIs go to every remote endpoint (one encoding, the same
+ * datagram for everyone - on Linux in a single sendmmsg call). A GUI that
+ * can't be sent to is skipped (and logged), the others still get it.
+ * Messages from GUIs are accepted from anywhere.
  */
 class UdpStreamBuffer : public StreamBuffer {
  private:
   static const uint16_t max_data_size = 65507;
   std::shared_ptr<boost::asio::ip::udp::socket> rec_sock;
-  boost::asio::ip::udp::endpoint remote_endpoint;
+  std::vector<boost::asio::ip::udp::endpoint> remote_endpoints;
   std::vector<uint8_t> internal_buff;
   size_t bytes_to_send_count{};
 
   size_t len{};
 
+#ifdef __linux__
+  /**
+   * Sends the buffer to all endpoints, as many datagrams per syscall as
+   * the kernel takes. sendmmsg stops at the first datagram that fails and
+   * only reports it if it is the first one of the call, so an error always
+   * belongs to msgs[sent].
+   */
+  void send_to_all() {
+    std::vector<iovec> iov(remote_endpoints.size(),
+                           {internal_buff.data(), bytes_to_send_count});
+    std::vector<mmsghdr> msgs(remote_endpoints.size());
+    for (size_t i = 0; i < remote_endpoints.size(); ++i) {
+      msgs[i].msg_hdr.msg_name = remote_endpoints[i].data();
+      msgs[i].msg_hdr.msg_namelen = (socklen_t)remote_endpoints[i].size();
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t sent = 0;
+    while (sent < msgs.size()) {
+      int res = sendmmsg(rec_sock->native_handle(), &msgs[sent],
+                         (unsigned int)(msgs.size() - sent), 0);
+      if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          rec_sock->wait(udp::socket::wait_write);
+          continue;
+        }
+        if (errno == EINTR) {
+          continue;
+        }
+        send_failed(remote_endpoints[sent],
+                    boost::system::error_code(
+                        errno, boost::system::system_category()));
+        res = 1;
+      }
+      sent += (size_t)res;
+    }
+  }
+#else
+  void send_to_all() {
+    for (auto& endpoint : remote_endpoints) {
+      boost::system::error_code error;
+      rec_sock->send_to(boost::asio::buffer(internal_buff, bytes_to_send_count),
+                        endpoint, 0, error);
+      if (error) {
+        send_failed(endpoint, error);
+      }
+    }
+  }
+#endif
+
+  static void send_failed(const boost::asio::ip::udp::endpoint& endpoint,
+                          const boost::system::error_code& error) {
+    std::cerr << "Sending to GUI " << endpoint << " failed: " << error.message()
+              << std::endl;
+  }
+
  public:
   explicit UdpStreamBuffer(std::shared_ptr<boost::asio::ip::udp::socket> sock,
-                           const std::string& remote_address,
+                           const std::vector<std::string>& remote_addresses,
                            boost::asio::io_context& io_context)
       : rec_sock(std::move(sock)), internal_buff(max_data_size) {
-    auto [remote_host, remote_port] = extract_host_and_port(remote_address);
     udp::resolver udp_resolver(io_context);
-    remote_endpoint = *udp_resolver.resolve(udp::v6(), remote_host, remote_port,
-                                            resolver_base::numeric_service |
-                                                resolver_base::v4_mapped |
-                                                resolver_base::all_matching);
+    for (auto& remote_address : remote_addresses) {
+      auto [remote_host, remote_port] = extract_host_and_port(remote_address);
+      remote_endpoints.push_back(*udp_resolver.resolve(
+          udp::v6(), remote_host, remote_port,
+          resolver_base::numeric_service | resolver_base::v4_mapped |
+              resolver_base::all_matching));
+    }
   };
+
+  explicit UdpStreamBuffer(std::shared_ptr<boost::asio::ip::udp::socket> sock,
+                           const std::string& remote_address,
+                           boost::asio::io_context& io_context)
+      : UdpStreamBuffer(std::move(sock),
+                        std::vector<std::string>{remote_address}, io_context){};
+
   void reset() override {
     bytes_to_send_count = 0;
   }
@@ -179,13 +342,191 @@ class UdpStreamBuffer : public StreamBuffer {
     bytes_to_send_count += n;
   }
   void send() override {
-    if (bytes_to_send_count != 0) {
+    if (bytes_to_send_count == 0) {
+      return;
+    }
+    if (remote_endpoints.size() == 1) {
       rec_sock->send_to(boost::asio::buffer(internal_buff, bytes_to_send_count),
-                        remote_endpoint);
+                        remote_endpoints.front());
+    } else {
+      send_to_all();
     }
   }
 
   ~UdpStreamBuffer() override = default;
 };
 
+/**
+ * Buffer backed by plain memory instead of a socket.
+ * Writes are appended to a growing vector (so a message can be encoded once
+ * and then stored or sent many times), reads are done from any memory region
+ * set with set_input (e.g. a memory-mapped file), one message after another.
+ */
+class MemoryStreamBuffer : public StreamBuffer {
+ private:
+  std::vector<uint8_t> output;
+  const uint8_t* input{};
+  size_t input_len{};
+  size_t read_offset{};
+
+ public:
+  MemoryStreamBuffer() = default;
+
+  void set_input(const uint8_t* data, size_t len) {
+    input = data;
+    input_len = len;
+    read_offset = 0;
+  }
+
+  [[nodiscard]] size_t get_read_offset() const {
+    return read_offset;
+  }
+
+  [[nodiscard]] const std::vector<uint8_t>& get_output() const {
+    return output;
+  }
+
+  void clear_output() {
+    output.clear();
+  }
+
+  void get_n_bytes(uint8_t n, std::vector<uint8_t>& data) override {
+    if (read_offset + n > input_len) {
+      throw MessageTooShortException();
+    }
+    memcpy(&data[0], input + read_offset, n);
+    read_offset += n;
+  }
+
+  void end_receive() override {
+  }
+
+  void reset() override {
+  }
+
+  void send() override {
+  }
+
+  void get() override {
+  }
+
+  void write_n_bytes(uint8_t n, std::vector<uint8_t> buffer) override {
+    output.insert(output.end(), buffer.begin(), buffer.begin() + n);
+  }
+
+  ~MemoryStreamBuffer() override = default;
+};
+
+/**
+ * Decorator of a (tcp) buffer for extension::framed - every message goes
+ * with a u32 (network order) length before it.
+ * Writes are collected into the current frame, closed by end_message()
+ * (or by send(), so a single message doesn't need it); send() passes all
+ * closed frames to the wrapped buffer in one write.
+ * Reads take a whole frame from the wrapped buffer (the header and the body
+ * - two reads) when the first byte of a message is needed; reset() drops
+ * whatever the last message didn't read, so the next one starts at a frame
+ * boundary whatever the last one was.
+ */
+class FramedStreamBuffer : public StreamBuffer {
+ public:
+  static const size_t header_size = sizeof(uint32_t);
+  // no message is anywhere near it, it only stops absurd allocations
+  static const uint32_t max_frame_size = 1 << 24;
+
+  /**
+   * Length from a frame header (header_size bytes), at most max_size.
+   */
+  static uint32_t frame_length(const uint8_t* header,
+                               size_t max_size = max_frame_size) {
+    uint32_t len;
+    memcpy(&len, header, sizeof(len));
+    len = ntohl(len);
+    if (len > max_size) {
+      throw MessageTooLongException();
+    }
+    return len;
+  }
+
+ private:
+  std::unique_ptr<StreamBuffer> inner;
+  size_t max_size;
+  std::vector<uint8_t> frame;
+  size_t frame_offset{};
+  bool frame_read{};
+  std::vector<uint8_t> outgoing;
+  size_t frame_begin{};
+
+  void read_frame() {
+    uint8_t header[header_size];
+    inner->read_bytes(header, header_size);
+    frame.resize(frame_length(header, max_size));
+    inner->read_bytes(frame.data(), frame.size());
+    frame_offset = 0;
+    frame_read = true;
+  }
+
+ public:
+  /**
+   * Frames read are at most max_size long (e.g. the stream's
+   * DecodeLimits::max_message_bytes).
+   */
+  explicit FramedStreamBuffer(std::unique_ptr<StreamBuffer> inner,
+                              size_t max_size = max_frame_size)
+      : inner(std::move(inner)), max_size(max_size) {
+    outgoing.resize(header_size);
+  }
+
+  void get_n_bytes(uint8_t n, std::vector<uint8_t>& data) override {
+    if (!frame_read) {
+      read_frame();
+    }
+    if (frame_offset + n > frame.size()) {
+      throw MessageTooShortException();
+    }
+    memcpy(data.data(), frame.data() + frame_offset, n);
+    frame_offset += n;
+  }
+
+  void end_receive() override {
+  }
+
+  void get() override {
+  }
+
+  void reset() override {
+    frame_read = false;
+    outgoing.resize(header_size);
+    frame_begin = 0;
+  }
+
+  void write_n_bytes(uint8_t n, std::vector<uint8_t> buffer) override {
+    outgoing.insert(outgoing.end(), buffer.begin(), buffer.begin() + n);
+  }
+
+  void end_message() override {
+    auto len = (uint32_t)(outgoing.size() - frame_begin - header_size);
+    if (len == 0) {
+      return;
+    }
+    len = htonl(len);
+    memcpy(outgoing.data() + frame_begin, &len, sizeof(len));
+    frame_begin = outgoing.size();
+    outgoing.resize(frame_begin + header_size);
+  }
+
+  void send() override {
+    end_message();
+    if (frame_begin == 0) {
+      return;
+    }
+    inner->write_bytes(outgoing.data(), frame_begin);
+    inner->send();
+    outgoing.resize(header_size);
+    frame_begin = 0;
+  }
+
+  ~FramedStreamBuffer() override = default;
+};
+
 #endif  // SIK_ZAD3_BUFFER_H
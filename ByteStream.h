@@ -3,25 +3,127 @@
 
 #include <netinet/in.h>
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <map>
 #include <memory>
 #include <set>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include "Buffer.h"
 
+class ByteStream;
+
+/**
+ * Types that sorted lists of can be written as differences between
+ * consecutive elements (in compact mode).
+ */
+template <typename T>
+concept DeltaEncodable = requires(T a, const T& prev, ByteStream& os) {
+  a.write_after(os, prev);
+  a.read_after(os, prev);
+};
+
+/**
+ * Bounds on what a peer can make the decoder allocate or loop over:
+ * elements of a single list, set or map, and bytes of a single message.
+ * Both are checked when a length is read, before anything is allocated,
+ * and a violation throws MessageTooLongException.
+ */
+struct DecodeLimits {
+  uint32_t max_elements = UINT32_MAX;
+  size_t max_message_bytes = SIZE_MAX;
+
+  /**
+   * Messages without any lists - everything a client or a GUI sends, and
+   * the server's messages before Hello: at most a few strings.
+   */
+  static DecodeLimits without_lists() {
+    return {0, 1024};
+  }
+
+  /**
+   * The server's messages in a game with these parameters (from Hello).
+   * The longest list is Turn 0's events (a move of every player and a block
+   * on every cell) or the bombs (every player can place one per turn and
+   * they last bomb_timer turns); a message has at
+   * most every player (a name and an address, its entries in the maps
+   * and a bomb exploding over the whole board) and the board's blocks.
+   * Positions are counted as varints, the longer encoding.
+   */
+  static DecodeLimits for_game(uint16_t size_x, uint16_t size_y,
+                               uint8_t players_count, uint16_t bomb_timer) {
+    uint64_t cells = (uint64_t)size_x * size_y;
+    uint64_t bombs = (uint64_t)players_count * (bomb_timer + 1);
+    uint64_t elements = std::max(
+        {cells + players_count, bombs, (uint64_t)players_count * 3 + 1});
+    uint64_t per_player = 1024 + 16 * (uint64_t)(bomb_timer + 1) + 6 * cells;
+    DecodeLimits limits;
+    limits.max_elements = (uint32_t)std::min<uint64_t>(elements, UINT32_MAX);
+    limits.max_message_bytes = (size_t)std::min<uint64_t>(
+        1024 + (players_count + 1) * per_player, SIZE_MAX);
+    return limits;
+  }
+};
+
 /**
  * It is a class that provides an easy interface for an associated buffer
  * that is supposed to be receiving/sending messages.
  * It stores its own local vector needed for single datatype read/writes from
  * an associated buffer.
+ * In compact mode (extension::compact) u16 and u32 are LEB128 varints and
+ * sorted sets of DeltaEncodable elements are delta-encoded - most of the
+ * numbers in the protocol are small, so most of their bytes are zeros.
  */
 class ByteStream {
  private:
   std::vector<uint8_t> data;
   std::unique_ptr<StreamBuffer> buffer;
+  bool compact = false;
+  DecodeLimits limits;
+  // read since begin_message()
+  size_t message_bytes{};
+
+  void read_n_bytes(uint8_t n) {
+    message_bytes += n;
+    if (message_bytes > limits.max_message_bytes) {
+      throw MessageTooLongException();
+    }
+    buffer->get_n_bytes(n, data);
+  }
+
+  void write_varint(uint32_t x) {
+    uint8_t n = 0;
+    do {
+      auto byte = (uint8_t)(x & 0x7f);
+      x >>= 7;
+      if (x != 0) {
+        byte |= 0x80;
+      }
+      data[n++] = byte;
+    } while (x != 0);
+    buffer->write_n_bytes(n, data);
+  }
+
+  uint32_t read_varint(uint32_t max) {
+    uint64_t x = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      read_n_bytes(1);
+      x |= (uint64_t)(data[0] & 0x7f) << shift;
+      if (x > max) {
+        throw InvalidNumberException();
+      }
+      if (!(data[0] & 0x80)) {
+        return (uint32_t)x;
+      }
+      if (shift > 28) {
+        throw InvalidNumberException();
+      }
+    }
+  }
 
  public:
   /**
@@ -32,6 +134,55 @@ class ByteStream {
   explicit ByteStream(std::unique_ptr<StreamBuffer> buff)
       : data(StreamBuffer::max_single_datatype_size), buffer(std::move(buff)){};
 
+  /**
+   * Puts a decorator (e.g. compression) between this stream and its buffer,
+   * for everything read/written from now on. Args go to the decorator's
+   * constructor after the wrapped buffer.
+   */
+  template <typename Decorator, typename... Args>
+  void wrap_buffer(Args&&... args) {
+    buffer = std::make_unique<Decorator>(std::move(buffer),
+                                         std::forward<Args>(args)...);
+  }
+
+  void set_compact(bool on) {
+    compact = on;
+  }
+
+  [[nodiscard]] bool is_compact() const {
+    return compact;
+  }
+
+  void set_limits(DecodeLimits new_limits) {
+    limits = new_limits;
+  }
+
+  [[nodiscard]] const DecodeLimits& get_limits() const {
+    return limits;
+  }
+
+  /**
+   * What is read from now on is a new message (for max_message_bytes).
+   */
+  void begin_message() {
+    message_bytes = 0;
+  }
+
+  /**
+   * Length of a list, set or map. Checked against the limits - also
+   * against the bytes the message has left, every element takes at least
+   * one - before anything is allocated or looped over.
+   */
+  uint32_t read_length() {
+    uint32_t len;
+    *this >> len;
+    if (len > limits.max_elements ||
+        len > limits.max_message_bytes - message_bytes) {
+      throw MessageTooLongException();
+    }
+    return len;
+  }
+
   /**
    * used to prepare the underlying buffer to read/write
    */
@@ -64,6 +215,20 @@ class ByteStream {
     buffer->send();
   }
 
+  /**
+   * Bytes already encoded (e.g. cached), written as they are.
+   */
+  void write_bytes(const uint8_t* src, size_t n) {
+    buffer->write_bytes(src, n);
+  }
+
+  /**
+   * Separates messages written before the next end_write().
+   */
+  void end_message() {
+    buffer->end_message();
+  }
+
   /**
    * Here are overloaded operators that provide an extremely easy interface
    * to work with this object.
@@ -75,12 +240,16 @@ class ByteStream {
   }
 
   ByteStream& operator>>(uint8_t& x) {
-    buffer->get_n_bytes(sizeof(x), data);
+    read_n_bytes(sizeof(x));
     x = data[0];
     return *this;
   }
 
   ByteStream& operator<<(uint16_t x) {
+    if (compact) {
+      write_varint(x);
+      return *this;
+    }
     x = htons(x);
     std::memcpy(&data[0], &x, sizeof(x));
     buffer->write_n_bytes(sizeof(x), data);
@@ -88,7 +257,11 @@ class ByteStream {
   }
 
   ByteStream& operator>>(uint16_t& x) {
-    buffer->get_n_bytes(sizeof(x), data);
+    if (compact) {
+      x = (uint16_t)read_varint(UINT16_MAX);
+      return *this;
+    }
+    read_n_bytes(sizeof(x));
     std::memcpy(&x, &data[0], sizeof(x));
     x = ntohs(x);
     return *this;
@@ -102,13 +275,17 @@ class ByteStream {
   }
 
   ByteStream& operator>>(uint64_t& x) {
-    buffer->get_n_bytes(sizeof(x), data);
+    read_n_bytes(sizeof(x));
     std::memcpy(&x, &data[0], sizeof(x));
     x = be64toh(x);
     return *this;
   }
 
   ByteStream& operator<<(uint32_t x) {
+    if (compact) {
+      write_varint(x);
+      return *this;
+    }
     x = htonl(x);
     std::memcpy(&data[0], &x, sizeof(x));
     buffer->write_n_bytes(sizeof(x), data);
@@ -116,14 +293,18 @@ class ByteStream {
   }
 
   ByteStream& operator>>(uint32_t& x) {
-    buffer->get_n_bytes(sizeof(x), data);
+    if (compact) {
+      x = read_varint(UINT32_MAX);
+      return *this;
+    }
+    read_n_bytes(sizeof(x));
     std::memcpy(&x, &data[0], sizeof(x));
     x = ntohl(x);
     return *this;
   }
 
   ByteStream& operator>>(char& x) {
-    buffer->get_n_bytes(sizeof(x), data);
+    read_n_bytes(sizeof(x));
     x = (char)data[0];
     return *this;
   }
@@ -138,12 +319,12 @@ class ByteStream {
     uint8_t length;
     *this >> length;
     s.resize(length);
-    buffer->get_n_bytes(length, data);
+    read_n_bytes(length);
     std::memcpy(s.data(), &data[0], s.size());
     return *this;
   }
 
-  ByteStream& operator<<(std::string s) {
+  ByteStream& operator<<(std::string_view s) {
     auto length = (uint8_t)s.size();
     *this << length;
     std::memcpy(&data[0], s.data(), length);
@@ -153,8 +334,7 @@ class ByteStream {
 
   template <typename T>
   ByteStream& operator>>(std::vector<T>& x) {
-    uint32_t len;
-    *this >> len;
+    uint32_t len = read_length();
     x.resize(len);
     for (size_t i = 0; i < len; ++i) {
       *this >> x[i];
@@ -174,10 +354,17 @@ class ByteStream {
 
   template <typename T>
   ByteStream& operator>>(std::set<T>& x) {
-    uint32_t len;
-    *this >> len;
-    T temp;
+    uint32_t len = read_length();
+    T temp{};
     for (size_t i = 0; i < len; ++i) {
+      if constexpr (DeltaEncodable<T>) {
+        if (compact) {
+          T prev = temp;
+          temp.read_after(*this, prev);
+          x.insert(temp);
+          continue;
+        }
+      }
       *this >> temp;
       x.insert(temp);
     }
@@ -188,6 +375,16 @@ class ByteStream {
   ByteStream& operator<<(std::set<T> x) {
     auto len = (uint32_t)x.size();
     *this << len;
+    if constexpr (DeltaEncodable<T>) {
+      if (compact) {
+        T prev{};
+        for (auto element : x) {
+          element.write_after(*this, prev);
+          prev = element;
+        }
+        return *this;
+      }
+    }
     for (auto element : x) {
       *this << element;
     }
@@ -196,8 +393,7 @@ class ByteStream {
 
   template <typename T1, typename T2>
   ByteStream& operator>>(std::map<T1, T2>& x) {
-    uint32_t len;
-    *this >> len;
+    uint32_t len = read_length();
     x.clear();
     std::pair<T1, T2> temp_val;
     for (size_t i = 0; i < len; ++i) {
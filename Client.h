@@ -3,17 +3,29 @@
 
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
+#include <chrono>
 #include <memory>
+#include <optional>
+#include <sstream>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 #include "Buffer.h"
 #include "ByteStream.h"
 #include "ClientState.h"
+#include "Compression.h"
 #include "Message.h"
+#include "MessageScanner.h"
 #include "ConnectionUtils.h"
+#include "SharedRing.h"
 
 using boost::asio::ip::resolver_base;
 using boost::asio::ip::tcp;
 using boost::asio::ip::udp;
+using boost::asio::local::stream_protocol;
 
 /**
  * Class that handles basic Client functionalities.
@@ -24,11 +36,413 @@ class Client {
  private:
   std::shared_ptr<udp::socket> udp_display_sock;
   ByteStream udp_stream;
-  std::shared_ptr<tcp::socket> tcp_server_sock;
+  // tcp or, for a server on the same host, unix domain socket
+  std::shared_ptr<StreamSocket> tcp_server_sock;
   ByteStream tcp_stream;
   std::string name;
   ClientState aggregated_state;
 
+  static const size_t tcp_chunk_size = 65536;
+  std::vector<uint8_t> tcp_chunk;
+  // received bytes that are not a whole message yet, scanner has seen them
+  std::vector<uint8_t> tcp_received;
+  ServerMessageScanner scanner;
+  // set up once the server agrees to extension::compress
+  std::optional<Inflater> inflater;
+  // compressed bytes not inflated yet - only a message's worth is inflated
+  // at a time
+  std::vector<uint8_t> deflated;
+  // the server agreed to extension::framed - messages both ways are framed
+  // and the scanner is not needed
+  bool framed = false;
+  MemoryStreamBuffer* message_buffer;
+  ByteStream message_stream;
+
+  // GUI gets at most one update per min_gui_interval (zero - no limit)
+  std::chrono::steady_clock::duration min_gui_interval;
+  std::chrono::steady_clock::time_point last_gui_update;
+  boost::asio::steady_timer gui_timer;
+  bool gui_update_pending = false;
+  bool gui_timer_armed = false;
+
+  // Prediction: the GUI is shown the last input of the local player
+  // applied on top of the state, until a turn shows the server used it.
+  // The server keeps one input per player per turn, so one is enough.
+  // Only what the input changes is kept - the state itself isn't copied.
+  bool predict;
+  std::string local_address;
+  std::optional<PlayerId> local_id;
+  std::shared_ptr<InputMessage> pending_input;
+  uint16_t pending_since{};
+  // turns it took for the last input to be confirmed
+  uint16_t confirm_lag = 1;
+  std::optional<Prediction> prediction;
+
+  // Resume: when the connection drops, the client connects again (with
+  // growing delays) and sends Resume, so the server sends only the turns it
+  // missed. Without a token (or if it's too late) it starts from Hello.
+  static const uint16_t max_reconnect_attempts = 10;
+  static constexpr std::chrono::milliseconds first_reconnect_delay{100};
+  static constexpr std::chrono::milliseconds max_reconnect_delay{2000};
+  bool resume;
+  uint32_t extensions;
+  boost::asio::generic::stream_protocol::endpoint server_endpoint;
+  bool local = false;
+  boost::asio::steady_timer reconnect_timer;
+  std::chrono::milliseconds reconnect_delay = first_reconnect_delay;
+  uint16_t reconnect_attempts{};
+  bool connected = true;
+  // reconnected, waiting for ResumeToken (resumed) or Hello (start over)
+  bool resuming = false;
+
+  // Input coalescing: the server uses only the last input of a player in
+  // a turn, so inputs are held and the last one is sent once per turn,
+  // a margin (RTT + jitter) before the turn is expected to end.
+  // Turn period is estimated from live Turn arrivals.
+  using clock = std::chrono::steady_clock;
+  bool coalesce_inputs;
+  std::shared_ptr<InputMessage> held_input;
+  boost::asio::steady_timer input_timer;
+  bool input_timer_armed = false;
+  std::optional<uint16_t> sent_in_turn;
+  std::optional<clock::time_point> last_turn_arrival;
+  uint16_t last_arrived_turn{};
+  clock::duration turn_period{};  // zero until measured
+  clock::duration turn_jitter{};
+
+  // extension::datagrams: turns also come in datagrams from the server's
+  // extensions port (each with a few last turns) and are applied when
+  // the next turn is among them. A bigger gap is left to tcp, which brings
+  // every turn anyway. Inputs go in datagrams, tagged with the last turn,
+  // once a datagram from the server has come.
+  std::shared_ptr<udp::socket> udp_server_sock;
+  std::vector<uint8_t> datagram_in;
+  // registration is repeated with every tcp turn until a datagram comes
+  bool datagram_arrived = false;
+  MemoryStreamBuffer* datagram_out_buffer;
+  ByteStream datagram_out_stream;
+  udp::endpoint datagram_endpoint;
+
+  // extension::shared_ring: the server's messages come through a ring in
+  // memory shared with it. ring_event (its eventfd) is only waited on when
+  // the ring is empty, the socket is still read to notice the server is gone.
+  std::unique_ptr<SharedRing> ring;
+  boost::asio::posix::stream_descriptor ring_event;
+  std::vector<uint8_t> ring_chunk;
+
+  /**
+   * Sends the current state to the GUI.
+   */
+  void send_to_gui() {
+    udp_stream.reset();
+    if (!aggregated_state.game_on) {
+      Lobby(aggregated_state).serialize(udp_stream);
+    } else {
+      Game(aggregated_state, prediction).serialize(udp_stream);
+    }
+    udp_stream.end_write();
+    last_gui_update = std::chrono::steady_clock::now();
+    gui_update_pending = false;
+  }
+
+  /**
+   * Called once everything received so far is applied. If the GUI was
+   * updated too recently, the update is postponed (and further changes are
+   * coalesced into it).
+   */
+  void flush_gui_update() {
+    if (!gui_update_pending || gui_timer_armed) {
+      return;
+    }
+    auto due = last_gui_update + min_gui_interval;
+    if (std::chrono::steady_clock::now() >= due) {
+      send_to_gui();
+      return;
+    }
+    gui_timer_armed = true;
+    gui_timer.expires_at(due);
+    gui_timer.async_wait([this](const boost::system::error_code& error) {
+      gui_timer_armed = false;
+      if (!error && gui_update_pending) {
+        send_to_gui();
+      }
+    });
+  }
+
+  void exit_on_error() {
+    boost::system::error_code ignored;
+    udp_display_sock->close(ignored);
+    tcp_server_sock->close(ignored);
+    exit(1);
+  }
+
+  /**
+   * Schedules connecting again if resume is on, exits otherwise.
+   */
+  void connection_lost() {
+    if (!resume || reconnect_attempts >= max_reconnect_attempts) {
+      exit_on_error();
+    }
+    connected = false;
+    boost::system::error_code ignored;
+    tcp_server_sock->close(ignored);
+    close_shared_ring();
+
+    reconnect_timer.expires_after(reconnect_delay);
+    reconnect_timer.async_wait([this](const boost::system::error_code& error) {
+      if (!error) {
+        reconnect();
+      }
+    });
+    reconnect_delay = std::min(reconnect_delay * 2, max_reconnect_delay);
+    reconnect_attempts++;
+  }
+
+  void reconnect() {
+    tcp_server_sock->open(server_endpoint.protocol());
+    if (!local) {
+      tcp_server_sock->set_option(tcp::no_delay(true));
+    }
+    tcp_server_sock->async_connect(
+        server_endpoint, [this](const boost::system::error_code& error) {
+          if (error) {
+            std::cerr << "Reconnecting failed: " << error.message()
+                      << std::endl;
+            connection_lost();
+            return;
+          }
+          connected = true;
+          resuming = true;
+          reconnect_attempts = 0;
+          reconnect_delay = first_reconnect_delay;
+          tcp_received.clear();
+          scanner = ServerMessageScanner();
+          scanner.set_limits(message_stream.get_limits());
+          message_stream.set_compact(false);
+          inflater.reset();
+          deflated.clear();
+          framed = false;
+          tcp_stream = ByteStream(
+              std::make_unique<StreamSocketBuffer>(tcp_server_sock));
+          close_datagram_channel();
+
+          try {
+            tcp_stream.reset();
+            if (aggregated_state.game_on && aggregated_state.resume_token) {
+              Resume(extensions, *aggregated_state.resume_token,
+                     aggregated_state.next_turn())
+                  .serialize(tcp_stream);
+            } else {
+              Extensions(extensions).serialize(tcp_stream);
+            }
+            tcp_stream.end_write();
+            if (extensions & extension::shared_ring) {
+              attach_shared_ring();
+            }
+          } catch (std::exception& e) {
+            connection_lost();
+            return;
+          }
+          tcp_start_receive();
+        });
+  }
+
+  /**
+   * Sends an input (Join while in the lobby) to the server.
+   */
+  void send_to_server(InputMessage& input) {
+    if (!connected || ((extensions & extension::framed) && !framed)) {
+      // the input would be lost anyway, the game continues without it
+      // (nothing is sent before the server says if it reads frames)
+      return;
+    }
+    // a datagram from the server confirms the channel works both ways,
+    // until then inputs go over tcp (a lost registration would lose them)
+    if (aggregated_state.game_on && udp_server_sock->is_open() &&
+        datagram_arrived) {
+      send_datagram(&input);
+      return;
+    }
+    try {
+      tcp_stream.reset();
+      if (!aggregated_state.game_on) {
+        Join(name).serialize(tcp_stream);
+      } else {
+        input.serialize(tcp_stream);
+      }
+      tcp_stream.end_write();
+    } catch (boost::system::system_error& e) {
+      // a broken connection is noticed (and resumed) by the receiving side
+      if (!resume) {
+        throw;
+      }
+    }
+  }
+
+  [[nodiscard]] clock::duration server_rtt() const {
+#ifdef __linux__
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(tcp_server_sock->native_handle(), IPPROTO_TCP, TCP_INFO,
+                   &info, &len) == 0) {
+      return std::chrono::microseconds(info.tcpi_rtt);
+    }
+#endif
+    return clock::duration::zero();
+  }
+
+  /**
+   * Called after everything received is applied. Only turns following
+   * the previous one directly are measured, so catching up doesn't count.
+   */
+  void turn_arrived() {
+    auto now = clock::now();
+    uint16_t turn = aggregated_state.turn;
+    if (!aggregated_state.game_on) {
+      last_turn_arrival.reset();
+      sent_in_turn.reset();
+      return;
+    }
+    if (last_turn_arrival && turn == last_arrived_turn) {
+      return;
+    }
+    if (last_turn_arrival && turn == last_arrived_turn + 1) {
+      auto sample = now - *last_turn_arrival;
+      if (turn_period == clock::duration::zero()) {
+        turn_period = sample;
+      } else {
+        auto deviation = sample > turn_period ? sample - turn_period
+                                              : turn_period - sample;
+        turn_period += (sample - turn_period) / 8;
+        turn_jitter += (deviation - turn_jitter) / 8;
+      }
+    }
+    last_turn_arrival = now;
+    last_arrived_turn = turn;
+  }
+
+  /**
+   * When the held input should be sent: before the current turn's expected
+   * end, or the next one's if an input was already sent in this turn.
+   * Now if the period is not known yet.
+   */
+  [[nodiscard]] clock::time_point input_send_point() const {
+    if (!last_turn_arrival || turn_period == clock::duration::zero()) {
+      return clock::now();
+    }
+    auto margin = server_rtt() + 4 * turn_jitter + std::chrono::milliseconds(1);
+    auto send_at = *last_turn_arrival + turn_period - margin;
+    if (sent_in_turn == aggregated_state.turn) {
+      send_at += turn_period;
+    }
+    return send_at;
+  }
+
+  /**
+   * An input held past the end of the game is dropped (in the lobby it
+   * would be sent as Join).
+   */
+  void send_held_input() {
+    if (held_input && aggregated_state.game_on) {
+      send_to_server(*held_input);
+      sent_in_turn = aggregated_state.turn;
+    }
+    held_input.reset();
+  }
+
+  void hold_input(std::shared_ptr<InputMessage> input) {
+    held_input = std::move(input);
+    if (input_timer_armed) {
+      return;
+    }
+    auto send_at = input_send_point();
+    if (clock::now() >= send_at) {
+      send_held_input();
+      return;
+    }
+    input_timer_armed = true;
+    input_timer.expires_at(send_at);
+    input_timer.async_wait([this](const boost::system::error_code& error) {
+      input_timer_armed = false;
+      if (error) {
+        return;
+      }
+      try {
+        send_held_input();
+      } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        exit_on_error();
+      }
+    });
+  }
+
+  /**
+   * The server sets player's address to the endpoint it sees,
+   * which is our local one.
+   */
+  void find_local_id() {
+    for (auto& player : *aggregated_state.players) {
+      if (player.name == name && player.address == local_address) {
+        local_id = player.id;
+        return;
+      }
+    }
+  }
+
+  /**
+   * Recomputes the prediction on top of the authoritative state.
+   * An input that changes nothing now (e.g. a move into a block that
+   * appeared meanwhile) is dropped.
+   */
+  void update_prediction() {
+    prediction.reset();
+    if (!pending_input || !local_id) {
+      pending_input.reset();
+      return;
+    }
+    prediction = pending_input->predict(aggregated_state, *local_id);
+    if (!prediction) {
+      pending_input.reset();
+    }
+  }
+
+  void predict_input(std::shared_ptr<InputMessage> input) {
+    if (!local_id) {
+      find_local_id();
+    }
+    pending_input = std::move(input);
+    pending_since = aggregated_state.turn;
+    update_prediction();
+    gui_update_pending = true;
+    flush_gui_update();
+  }
+
+  /**
+   * Called after a turn is applied. If the local player moved or placed
+   * a bomb in it, the server has used the pending input. Otherwise it may
+   * still be on its way, so it is applied to the new state again - unless
+   * it is pending for longer than the last confirmation took.
+   */
+  void reconcile(std::optional<Position> position_before) {
+    if (!pending_input || !local_id) {
+      return;
+    }
+    auto& state = aggregated_state;
+    bool confirmed =
+        position_before && state.positions.contains(*local_id) &&
+        (!(state.positions.at(*local_id) == *position_before) ||
+         state.has_new_bomb_at(*position_before));
+    auto lag = (uint16_t)(state.turn - pending_since);
+
+    if (confirmed) {
+      confirm_lag = lag;
+      pending_input.reset();
+    } else if (lag > confirm_lag + 1) {
+      pending_input.reset();
+    }
+    update_prediction();
+  }
+
   /**
    * Function that starts asynchronously listening for UDP messages.
    */
@@ -71,13 +485,15 @@ class Client {
         return;
       }
 
-      tcp_stream.reset();
-      if (!aggregated_state.game_on) {
-        Join(name).serialize(tcp_stream);
+      if (coalesce_inputs && aggregated_state.game_on) {
+        hold_input(received_message);
       } else {
-        received_message->serialize(tcp_stream);
+        send_to_server(*received_message);
+      }
+
+      if (predict && aggregated_state.game_on && connected) {
+        predict_input(received_message);
       }
-      tcp_stream.end_write();
       udp_start_receive();
     } catch (std::exception& e) {
       std::cerr << e.what() << std::endl;
@@ -88,43 +504,323 @@ class Client {
   }
 
   /**
-   * Function that starts asynchronously listening for TCP messages.
+   * Function that starts asynchronously reading whatever the server sent.
    */
   void tcp_start_receive() {
-    tcp_server_sock->async_wait(tcp::socket::wait_read,
-                                boost::bind(&Client::tcp_msg_rcv_handler, this,
-                                            boost::asio::placeholders::error));
+    tcp_server_sock->async_read_some(
+        boost::asio::buffer(tcp_chunk),
+        boost::bind(&Client::tcp_msg_rcv_handler, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
   }
 
   /**
-   * Method for handling messages from the server.
-   * First check if boost didn't log any errors, then
-   * prepares an appropriate buffer wrapper and tries to deserialize
-   * a message.
-   * After that, the message is used to update client state and an
-   * appropriate (if any) message to be sent to GUI is prepared and sent.
+   * token: u64, the last turn: u16 and the input (none - only registers
+   * the socket).
+   */
+  void send_datagram(InputMessage* input) {
+    datagram_out_buffer->clear_output();
+    datagram_out_stream << *aggregated_state.datagram_token
+                        << aggregated_state.turn;
+    if (input) {
+      input->serialize(datagram_out_stream);
+    }
+    boost::system::error_code ignored;
+    udp_server_sock->send(
+        boost::asio::buffer(datagram_out_buffer->get_output()), 0, ignored);
+  }
+
+  /**
+   * Connected to the server's extensions port (udp), so only the server's
+   * datagrams come in.
+   */
+  void open_datagram_channel() {
+    close_datagram_channel();
+    udp_server_sock->open(udp::v6());
+    udp_server_sock->connect(datagram_endpoint);
+    send_datagram(nullptr);
+    datagram_start_receive();
+  }
+
+  void close_datagram_channel() {
+    boost::system::error_code ignored;
+    udp_server_sock->close(ignored);
+    aggregated_state.datagram_token.reset();
+    datagram_arrived = false;
+  }
+
+  void datagram_start_receive() {
+    udp_server_sock->async_receive(
+        boost::asio::buffer(datagram_in),
+        boost::bind(&Client::datagram_rcv_handler, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
+  }
+
+  /**
+   * count: u8 and that many turns, oldest first. Only the one right after
+   * the last applied turn (and the ones after it) are used, and only when
+   * tcp has already brought the game's beginning.
+   */
+  void handle_turn_datagram(size_t len) {
+    message_buffer->set_input(datagram_in.data(), len);
+    uint8_t count;
+    message_stream >> count;
+    for (uint8_t i = 0; i < count; ++i) {
+      auto message = ServerMessage::deserialize(message_stream);
+      auto turn = std::dynamic_pointer_cast<Turn>(message);
+      if (!turn) {
+        throw InvalidMessageException();
+      }
+      if (!resuming && aggregated_state.game_on &&
+          aggregated_state.turn_applied &&
+          turn->get_turn() == (uint16_t)(aggregated_state.turn + 1)) {
+        apply_server_message(message);
+      }
+    }
+  }
+
+  /**
+   * A broken datagram is dropped, tcp brings the same turns anyway.
+   */
+  void datagram_rcv_handler(const boost::system::error_code& error,
+                            size_t bytes) {
+    if (error == boost::asio::error::operation_aborted) {
+      return;  // closed, the connection is being resumed
+    }
+    if (!error) {
+      datagram_arrived = true;
+      try {
+        handle_turn_datagram(bytes);
+      } catch (std::exception& e) {
+      }
+      turn_arrived();
+      flush_gui_update();
+    }
+    datagram_start_receive();
+  }
+
+  /**
+   * Handles a single, complete message from the server.
+   * The message is used to update client state, the GUI is only marked
+   * as needing an update.
+   */
+  void handle_server_message(const uint8_t* data, size_t len) {
+    message_buffer->set_input(data, len);
+    std::shared_ptr<ServerMessage> rec_message =
+        ServerMessage::deserialize(message_stream);
+    if (message_buffer->get_read_offset() != len) {
+      throw InvalidMessageException();
+    }
+    apply_server_message(rec_message);
+    if (std::dynamic_pointer_cast<DatagramChannel>(rec_message)) {
+      open_datagram_channel();
+    }
+  }
+
+  /**
+   * Whatever the server sends is decoded within limits - before Hello for
+   * messages without lists, then derived from the game's parameters.
+   */
+  void set_decode_limits(DecodeLimits limits) {
+    message_stream.set_limits(limits);
+    scanner.set_limits(limits);
+  }
+
+  void apply_server_message(const std::shared_ptr<ServerMessage>& rec_message) {
+    if (resuming) {
+      if (std::dynamic_pointer_cast<ResumeToken>(rec_message)) {
+        resuming = false;
+      } else if (std::dynamic_pointer_cast<Hello>(rec_message)) {
+        // the server didn't take us back, everything is sent from scratch
+        resuming = false;
+        aggregated_state.reset();
+      }
+    }
+
+    std::optional<Position> position_before;
+    uint16_t turn_before = aggregated_state.turn;
+    if (local_id && aggregated_state.positions.contains(*local_id)) {
+      position_before = aggregated_state.positions.at(*local_id);
+    }
+
+    if (rec_message->update_client_state(aggregated_state)) {
+      gui_update_pending = true;
+    }
+    if (std::dynamic_pointer_cast<Hello>(rec_message)) {
+      set_decode_limits(DecodeLimits::for_game(
+          aggregated_state.size_x, aggregated_state.size_y,
+          aggregated_state.players_count, aggregated_state.bomb_timer));
+    }
+
+    if (!aggregated_state.game_on) {
+      local_id.reset();
+      pending_input.reset();
+      prediction.reset();
+    } else if (aggregated_state.turn != turn_before) {
+      reconcile(position_before);
+    }
+  }
+
+  /**
+   * Everything after ExtensionsAccepted that allowed compression (starting
+   * at from) is compressed - it is moved to deflated, to be inflated.
+   */
+  void start_inflating(size_t from) {
+    deflated.assign(tcp_received.begin() + (ptrdiff_t)from,
+                    tcp_received.end());
+    tcp_received.resize(from);
+    inflater.emplace();
+  }
+
+  /**
+   * What the server agreed to in ExtensionsAccepted applies to everything
+   * after it (it ends at from in tcp_received).
+   */
+  void use_accepted_extensions(size_t from) {
+    if (!inflater && (aggregated_state.extensions & extension::compress)) {
+      start_inflating(from);
+    }
+    if (!message_stream.is_compact() &&
+        (aggregated_state.extensions & extension::compact)) {
+      scanner.set_compact(true);
+      message_stream.set_compact(true);
+    }
+    if (!framed && (aggregated_state.extensions & extension::framed)) {
+      framed = true;
+      tcp_stream.wrap_buffer<FramedStreamBuffer>();
+    }
+  }
+
+  /**
+   * Length of the frame starting at begin (with its header), if it is
+   * all there.
+   */
+  [[nodiscard]] std::optional<size_t> complete_frame(size_t begin) const {
+    size_t available = tcp_received.size() - begin;
+    if (available < FramedStreamBuffer::header_size) {
+      return std::nullopt;
+    }
+    size_t len = FramedStreamBuffer::header_size +
+                 FramedStreamBuffer::frame_length(
+                     tcp_received.data() + begin,
+                     message_stream.get_limits().max_message_bytes);
+    if (available < len) {
+      return std::nullopt;
+    }
+    return len;
+  }
+
+  /**
+   * A message that can't be parsed (e.g. of a type this client doesn't know)
+   * is skipped, the next one starts at its own frame anyway.
+   */
+  void handle_frame(const uint8_t* data, size_t len) {
+    try {
+      handle_server_message(data + FramedStreamBuffer::header_size,
+                            len - FramedStreamBuffer::header_size);
+    } catch (InvalidMessageException& e) {
+    } catch (MessageTooShortException& e) {
+    }
+  }
+
+  /**
+   * The new bytes from the server (socket or ring) are passed through
+   * the scanner (or split into frames) and every message that is complete
+   * now is handled. What is left (the beginning of the next message) waits
+   * for the next chunk, so a partially received message never blocks
+   * anything. Compressed bytes are inflated at most max_message_bytes past
+   * what is buffered at a time, and a beginning of a message that is
+   * already longer than that throws MessageTooLongException.
+   */
+  void handle_server_bytes(const uint8_t* data, size_t bytes) {
+    size_t scanned = tcp_received.size();
+    if (inflater) {
+      deflated.insert(deflated.end(), data, data + bytes);
+    } else {
+      tcp_received.insert(tcp_received.end(), data, data + bytes);
+    }
+
+    for (;;) {
+      size_t max_message = message_stream.get_limits().max_message_bytes;
+      if (inflater && !deflated.empty()) {
+        size_t used =
+            inflater->inflate(deflated.data(), deflated.size(), tcp_received,
+                              tcp_received.size() + max_message);
+        deflated.erase(deflated.begin(), deflated.begin() + (ptrdiff_t)used);
+      }
+      handle_received(scanned);
+      // Hello may have changed the limits
+      if (tcp_received.size() >
+          message_stream.get_limits().max_message_bytes) {
+        throw MessageTooLongException();
+      }
+      if (!inflater || deflated.empty()) {
+        return;
+      }
+      scanned = tcp_received.size();
+    }
+  }
+
+  /**
+   * Handles the complete messages in tcp_received, the scanner has already
+   * seen the bytes before scanned.
+   */
+  void handle_received(size_t scanned) {
+    size_t message_begin = 0;
+    while (scanned < tcp_received.size()) {
+      if (framed) {
+        auto frame_len = complete_frame(message_begin);
+        if (!frame_len) {
+          break;
+        }
+        scanned = message_begin + *frame_len;
+        handle_frame(tcp_received.data() + message_begin, *frame_len);
+        message_begin = scanned;
+        continue;
+      }
+
+      auto message_len = scanner.scan(tcp_received.data() + scanned,
+                                      tcp_received.size() - scanned);
+      if (!message_len) {
+        break;
+      }
+      scanned += *message_len;
+      handle_server_message(tcp_received.data() + message_begin,
+                            scanned - message_begin);
+      message_begin = scanned;
+      use_accepted_extensions(scanned);
+    }
+    tcp_received.erase(tcp_received.begin(),
+                       tcp_received.begin() + (ptrdiff_t)message_begin);
+  }
+
+  /**
+   * Method for handling bytes from the server.
+   * First check if boost didn't log any errors, then the bytes are handled.
+   * The GUI is updated once, after everything the socket had is applied
+   * (so catching up on a long history costs one update, not one per turn).
    * @param error any error logged by boost
+   * @param bytes number of bytes read
    */
-  void tcp_msg_rcv_handler(const boost::system::error_code& error) {
+  void tcp_msg_rcv_handler(const boost::system::error_code& error,
+                           size_t bytes) {
     if (error) {
       std::cerr << "Boost error: " << error << std::endl;
-      exit(1);
+      connection_lost();
+      return;
     }
     try {
-      tcp_stream.reset();
-      std::shared_ptr<ServerMessage> rec_message =
-          ServerMessage::deserialize(tcp_stream);
-
-      if (rec_message->update_client_state(aggregated_state)) {
-        udp_stream.reset();
-        if (!aggregated_state.game_on) {
-          Lobby(aggregated_state).serialize(udp_stream);
-        } else {
-          Game(aggregated_state).serialize(udp_stream);
+      handle_server_bytes(tcp_chunk.data(), bytes);
+
+      if (tcp_server_sock->available() == 0) {
+        turn_arrived();
+        flush_gui_update();
+        if (udp_server_sock->is_open() && !datagram_arrived &&
+            aggregated_state.game_on) {
+          send_datagram(nullptr);
         }
-        udp_stream.end_write();
       }
-
       tcp_start_receive();
     } catch (std::exception& e) {
       std::cerr << e.what() << std::endl;
@@ -134,6 +830,71 @@ class Client {
     }
   }
 
+  /**
+   * extension::shared_ring: ExtensionsAccepted comes over the socket and
+   * right after it (if the ring was accepted) the ring's descriptors.
+   * It is read synchronously, before anything else is read from the socket.
+   */
+  void attach_shared_ring() {
+    std::vector<uint8_t> accepted(sizeof(uint8_t) + sizeof(uint32_t));
+    boost::asio::read(*tcp_server_sock, boost::asio::buffer(accepted));
+    handle_server_message(accepted.data(), accepted.size());
+    if (aggregated_state.extensions & extension::shared_ring) {
+      auto fds = receive_fds(tcp_server_sock->native_handle(), 2);
+      ring = SharedRing::attach(fds[0], fds[1]);
+      ::close(fds[0]);  // the mapping stays
+      ring_event.assign(::dup(ring->get_event_fd()));
+    }
+    use_accepted_extensions(tcp_received.size());
+    if (ring) {
+      drain_shared_ring();
+    }
+  }
+
+  void close_shared_ring() {
+    boost::system::error_code ignored;
+    ring_event.close(ignored);
+    ring.reset();
+  }
+
+  /**
+   * Handles everything in the ring, then waits for the server to wake us
+   * up. While it is being drained the server doesn't wake us up.
+   */
+  void drain_shared_ring() {
+    for (;;) {
+      ring_chunk.clear();
+      if (ring->read_all(ring_chunk) > 0) {
+        handle_server_bytes(ring_chunk.data(), ring_chunk.size());
+      } else if (ring->prepare_sleep()) {
+        break;
+      }
+    }
+    ring_event.async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        boost::bind(&Client::ring_rcv_handler, this,
+                    boost::asio::placeholders::error));
+  }
+
+  /**
+   * An error means the ring was closed - the socket has noticed
+   * the connection is gone.
+   */
+  void ring_rcv_handler(const boost::system::error_code& error) {
+    if (error) {
+      return;
+    }
+    try {
+      ring->clear_event();
+      drain_shared_ring();
+      turn_arrived();
+      flush_gui_update();
+    } catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      exit_on_error();
+    }
+  }
+
  public:
   /**
    * This constructor initializes all fields. To the tcp_receive_stream we pass
@@ -146,26 +907,75 @@ class Client {
       : udp_display_sock(std::make_shared<udp::socket>(
             io_context, udp::endpoint(udp::v6(), opts.port))),
         udp_stream(std::make_unique<UdpStreamBuffer>(
-            udp_display_sock, opts.display_address, io_context)),
-        tcp_server_sock(std::make_shared<tcp::socket>(
-            io_context, tcp::endpoint(tcp::v6(), opts.port))),
-        tcp_stream(std::make_unique<TcpStreamBuffer>(tcp_server_sock)),
-        name(opts.player_name) {
-
-    // finding server endpoint
-    auto [server_host, server_port] =
-        extract_host_and_port(opts.server_address);
-    tcp::resolver tcp_resolver(io_context);
-
-    tcp::endpoint server_endpoint = *tcp_resolver.resolve(
-        tcp::v6(), server_host, server_port,
-        resolver_base::numeric_service | resolver_base::v4_mapped |
-            resolver_base::all_matching);
-
-    boost::asio::ip::tcp::no_delay option(true);
-    tcp_server_sock->set_option(option);
-
-    tcp_server_sock->connect(server_endpoint);
+            udp_display_sock, opts.display_addresses, io_context)),
+        tcp_server_sock(std::make_shared<StreamSocket>(io_context)),
+        tcp_stream(std::make_unique<StreamSocketBuffer>(tcp_server_sock)),
+        name(opts.player_name),
+        tcp_chunk(tcp_chunk_size),
+        message_buffer(new MemoryStreamBuffer()),
+        message_stream(std::unique_ptr<StreamBuffer>(message_buffer)),
+        min_gui_interval(
+            opts.max_gui_rate == 0
+                ? std::chrono::steady_clock::duration::zero()
+                : std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                      std::chrono::seconds(1)) /
+                      opts.max_gui_rate),
+        gui_timer(io_context),
+        predict(opts.predict),
+        resume(opts.resume),
+        extensions(opts.get_extensions()),
+        reconnect_timer(io_context),
+        coalesce_inputs(opts.coalesce_inputs),
+        input_timer(io_context),
+        udp_server_sock(std::make_shared<udp::socket>(io_context)),
+        datagram_in(UINT16_MAX),
+        datagram_out_buffer(new MemoryStreamBuffer()),
+        datagram_out_stream(
+            std::unique_ptr<StreamBuffer>(datagram_out_buffer)),
+        ring_event(io_context) {
+    udp_stream.set_limits(DecodeLimits::without_lists());
+    set_decode_limits(DecodeLimits::without_lists());
+    if (auto path = extract_local_path(opts.server_address)) {
+      // the server shows us as the pid on its end of the unix socket
+      local = true;
+      server_endpoint = stream_protocol::endpoint(*path);
+      tcp_server_sock->connect(server_endpoint);
+      local_address = "unix:" + std::to_string(getpid());
+    } else {
+      // finding server endpoint
+      auto [server_host, server_port] =
+          extract_host_and_port(opts.server_address);
+      tcp::resolver tcp_resolver(io_context);
+
+      tcp::endpoint server_tcp_endpoint = *tcp_resolver.resolve(
+          tcp::v6(), server_host, server_port,
+          resolver_base::numeric_service | resolver_base::v4_mapped |
+              resolver_base::all_matching);
+      server_endpoint = server_tcp_endpoint;
+      datagram_endpoint = udp::endpoint(server_tcp_endpoint.address(),
+                                        server_tcp_endpoint.port());
+
+      tcp::socket sock(io_context, tcp::endpoint(tcp::v6(), opts.port));
+      boost::asio::ip::tcp::no_delay option(true);
+      sock.set_option(option);
+
+      sock.connect(server_tcp_endpoint);
+
+      std::ostringstream local_endpoint;
+      local_endpoint << sock.local_endpoint();
+      local_address = local_endpoint.str();
+      *tcp_server_sock = std::move(sock);
+    }
+
+    // the unix socket is served like the extensions port
+    if (extensions != 0 || local) {
+      tcp_stream.reset();
+      Extensions(extensions).serialize(tcp_stream);
+      tcp_stream.end_write();
+      if (extensions & extension::shared_ring) {
+        attach_shared_ring();
+      }
+    }
 
     tcp_start_receive();
     udp_start_receive();
@@ -1,13 +1,19 @@
 #ifndef SIK_ZAD3_CLIENTSTATE_H
 #define SIK_ZAD3_CLIENTSTATE_H
 
+#include <bitset>
 #include <boost/program_options.hpp>
 #include <iostream>
 #include <map>
-#include <set>
+#include <optional>
 #include <string>
+#include <vector>
 
+#include "Board.h"
+#include "ConnectionUtils.h"
 #include "MessageUtils.h"
+#include "PlayerMap.h"
+#include "Roster.h"
 
 namespace po = boost::program_options;
 
@@ -18,23 +24,96 @@ namespace po = boost::program_options;
  * If no help is detected, all of the other options are required.
  */
 struct ClientCommandLineOpts {
-  std::string display_address;
+  std::vector<std::string> display_addresses;
   std::string player_name;
   uint16_t port;
   std::string server_address;
+  bool snapshot{};
+  uint16_t max_gui_rate{};
+  bool predict{};
+  bool resume{};
+  bool coalesce_inputs{};
+  bool compress{};
+  bool compact{};
+  bool framed{};
+  bool udp_turns{};
+
+  /**
+   * Mask of protocol extensions to ask the server for.
+   */
+  [[nodiscard]] uint32_t get_extensions() const {
+    uint32_t flags = 0;
+    if (snapshot) {
+      flags |= extension::snapshot;
+    }
+    if (resume) {
+      flags |= extension::resume;
+    }
+    if (compress) {
+      flags |= extension::compress;
+    }
+    if (compact) {
+      flags |= extension::compact;
+    }
+    if (framed) {
+      flags |= extension::framed;
+    }
+    if (udp_turns) {
+      flags |= extension::datagrams;
+    }
+    if (is_shared_ring_address(server_address)) {
+      flags |= extension::shared_ring;
+    }
+    return flags;
+  }
 
   bool parse_command_line(int argc, char *argv[]) {
     try {
       po::options_description desc("Opcje programu:");
       desc.add_options()
-          ("gui-address,d", po::value<std::string>(&display_address)->required(),
-          "<(nazwa hosta):(port) lub (IPv4):(port) lub (IPv6):(port)>")
+          ("gui-address,d",
+          po::value<std::vector<std::string>>(&display_addresses)->required(),
+          "<(nazwa hosta):(port) lub (IPv4):(port) lub (IPv6):(port)>, "
+          "can be given many times (every GUI gets the same messages)")
           ("help,h", "Wypisuje jak używać programu")
           ("player-name,n", po::value<std::string>(&player_name)->required(),
           "<String>")
           ("port,p", po::value<uint16_t>(&port)->required(),"<u16>")
           ("server-address,s",po::value<std::string>(&server_address)->required(),
-          "<(nazwa hosta):(port) lub (IPv4):(port) lub (IPv6):(port)>");
+          "<(nazwa hosta):(port) lub (IPv4):(port) lub (IPv6):(port)>, "
+          "or for a server on the same host unix:(path of its unix-socket), "
+          "or shm:(the same path) - then its messages come through shared "
+          "memory")
+          ("max-gui-rate,r", po::value<uint16_t>(&max_gui_rate)->default_value(0),
+          "<u16, max GUI updates per second, 0 - no limit>")
+          ("predict", po::bool_switch(&predict),
+          "shows own moves and bombs right away, before the server confirms "
+          "them")
+          ("coalesce-inputs", po::bool_switch(&coalesce_inputs),
+          "sends only the last input of every turn, shortly before the "
+          "server is expected to end the turn")
+          ("compact", po::bool_switch(&compact),
+          "server's messages use varints and delta-encoded positions "
+          "(server-address has to be the server's extensions port)")
+          ("udp-turns", po::bool_switch(&udp_turns),
+          "turns also come over udp (each datagram repeats a few last "
+          "ones) and inputs go over udp, so a lost tcp segment doesn't "
+          "delay turns (server-address has to be the server's extensions "
+          "port)")
+          ("framed", po::bool_switch(&framed),
+          "every message goes with its length, so the stream survives "
+          "messages it doesn't understand (server-address has to be the "
+          "server's extensions port)")
+          ("compress", po::bool_switch(&compress),
+          "server's messages come deflated (server-address has to be the "
+          "server's extensions port)")
+          ("resume", po::bool_switch(&resume),
+          "after the connection to the server drops, connects again and "
+          "continues the game (server-address has to be the server's "
+          "extensions port)")
+          ("snapshot", po::bool_switch(&snapshot),
+          "late join gets a state snapshot instead of the whole history "
+          "(server-address has to be the server's extensions port)");
 
       po::variables_map vm;
       po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -57,12 +136,26 @@ struct ClientCommandLineOpts {
   }
 };
 
+/**
+ * The local player's input applied on top of a client state, without
+ * copying the state: where the player is going to be and whether there is
+ * going to be a new bomb under it.
+ */
+struct Prediction {
+  PlayerId id{};
+  Position position;
+  bool bomb{};
+};
+
 /**
  * Struct for storing ClientState.
  * At all times there will only be one ClientState (for one Client).
  * It will never be used polymorphically nor will it have subclasses.
  * It's main function is to just store data, that's why I chose struct over
  * class.
+ * Per-player data is kept in flat arrays indexed by id and positions on
+ * the board in bitmaps, so applying a turn only touches what the turn's
+ * events touch, no matter how many blocks there are.
  */
 struct ClientState {
   std::string server_name;
@@ -72,18 +165,35 @@ struct ClientState {
   uint16_t game_length;
   uint16_t explosion_radius;
   uint16_t bomb_timer;
-  std::map<PlayerId, Player> players;
+  std::shared_ptr<const Roster> players = Roster::empty();
   uint16_t turn;
-  std::map<PlayerId, Position> positions;
-  std::set<Position> blocks;
+  // a Turn (or a snapshot) of this game has been applied, turn is its number
+  bool turn_applied{};
+  PlayerMap<Position> positions;
+  Board blocks;
   std::map<BombId, Bomb> bombs;
-  std::set<Position> explosions;
-  std::map<PlayerId, Score> scores;
-  std::set<PlayerId> would_die;
-  std::set<Position> blocks_to_destroy;
+  // this turn's explosions, emptied with reset() at the start of every turn
+  Board explosions;
+  PlayerMap<Score> scores;
+  std::bitset<256> would_die;
+  std::vector<Position> blocks_to_destroy;
+  // extensions granted by the server
+  uint32_t extensions{};
+  // from ResumeToken, valid until the game ends
+  std::optional<uint64_t> resume_token;
+  // from DatagramChannel, valid as long as the connection
+  std::optional<uint64_t> datagram_token;
 
   bool game_on = false;
 
+  /**
+   * The first turn of the game this state doesn't have yet (0 - not even
+   * Turn 0, e.g. right after GameStarted).
+   */
+  [[nodiscard]] uint32_t next_turn() const {
+    return turn_applied ? (uint32_t)turn + 1 : 0;
+  }
+
   /**
    * Ease function to add new bomb (we have the bomb timer ready)
    */
@@ -91,6 +201,58 @@ struct ClientState {
     bombs[id] = {pos, bomb_timer};
   }
 
+  /**
+   * Moves the player one step, with the same rules as the server
+   * (ServerState::move_player_in_direction). Nothing if it can't move.
+   */
+  [[nodiscard]] std::optional<Prediction> predict_move(PlayerId id,
+                                                       uint8_t dir) const {
+    if (!positions.contains(id)) {
+      return std::nullopt;
+    }
+    Position pos = positions.at(id);
+    switch (dir) {
+      case 0:
+        pos.y++;
+        break;
+      case 1:
+        pos.x++;
+        break;
+      case 2:
+        pos.y--;
+        break;
+      case 3:
+        pos.x--;
+        break;
+      default:
+        return std::nullopt;
+    }
+
+    if (blocks.contains(pos) || pos.x >= size_x || pos.y >= size_y) {
+      return std::nullopt;  // negative coordinates wrap around to >= size
+    }
+    return Prediction{id, pos, false};
+  }
+
+  [[nodiscard]] std::optional<Prediction> predict_bomb(PlayerId id) const {
+    if (!positions.contains(id)) {
+      return std::nullopt;
+    }
+    return Prediction{id, positions.at(id), true};
+  }
+
+  /**
+   * Whether a bomb was placed at pos in the last turn.
+   */
+  [[nodiscard]] bool has_new_bomb_at(Position pos) const {
+    for (auto &[id, bomb] : bombs) {
+      if (bomb.position == pos && bomb.timer == bomb_timer) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   /**
    * Function that calculates current round's explosions.
    * It goes explosion_radius - 1 times to all 4 sides, unless it
@@ -146,14 +308,17 @@ struct ClientState {
    * Prepares the clientstate for a new game (on the same server).
    */
   void reset() {
-    players.clear();
+    players = Roster::empty();
     turn = 0;
+    turn_applied = false;
     positions.clear();
     blocks.clear();
     bombs.clear();
     explosions.clear();
     scores.clear();
-    would_die.clear();
+    would_die.reset();
+    blocks_to_destroy.clear();
+    resume_token.reset();
     game_on = false;
   }
 };
@@ -0,0 +1,156 @@
+#ifndef SIK_ZAD2_COMPRESSION_H
+#define SIK_ZAD2_COMPRESSION_H
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "Buffer.h"
+
+class CompressionException : public BufferException {
+  [[nodiscard]] const char* what() const noexcept override {
+    return "Compressed stream is broken";
+  }
+};
+
+/**
+ * Decorator of a (tcp) buffer that deflates everything written to it.
+ * There is one deflate stream for the whole connection, so what was sent
+ * before works as a dictionary for what comes next (the same ids, positions
+ * and tags repeat all the time). Every send() is a Z_PARTIAL_FLUSH, so
+ * the receiver can decode a message as soon as it gets it (it costs ~2 bytes
+ * per send, Z_SYNC_FLUSH would cost ~5 - a lot for a 10 byte Turn).
+ * Reads go to the wrapped buffer untouched.
+ */
+class DeflateStreamBuffer : public StreamBuffer {
+ private:
+  std::unique_ptr<StreamBuffer> inner;
+  z_stream stream{};
+  std::vector<uint8_t> pending;
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> piece;
+
+ public:
+  explicit DeflateStreamBuffer(std::unique_ptr<StreamBuffer> inner)
+      : inner(std::move(inner)), piece(max_single_datatype_size) {
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      throw CompressionException();
+    }
+  }
+
+  DeflateStreamBuffer(const DeflateStreamBuffer&) = delete;
+  DeflateStreamBuffer& operator=(const DeflateStreamBuffer&) = delete;
+
+  void get_n_bytes(uint8_t n, std::vector<uint8_t>& data) override {
+    inner->get_n_bytes(n, data);
+  }
+
+  void end_receive() override {
+    inner->end_receive();
+  }
+
+  void get() override {
+    inner->get();
+  }
+
+  void reset() override {
+    pending.clear();
+    inner->reset();
+  }
+
+  void write_n_bytes(uint8_t n, std::vector<uint8_t> buffer) override {
+    pending.insert(pending.end(), buffer.begin(), buffer.begin() + n);
+  }
+
+  void send() override {
+    if (pending.empty()) {
+      return;
+    }
+
+    stream.next_in = pending.data();
+    stream.avail_in = (uInt)pending.size();
+    size_t out_len = 0;
+    do {
+      compressed.resize(out_len + deflateBound(&stream, stream.avail_in) + 16);
+      stream.next_out = compressed.data() + out_len;
+      stream.avail_out = (uInt)(compressed.size() - out_len);
+      if (deflate(&stream, Z_PARTIAL_FLUSH) == Z_STREAM_ERROR) {
+        throw CompressionException();
+      }
+      out_len = compressed.size() - stream.avail_out;
+    } while (stream.avail_out == 0);
+    pending.clear();
+
+    size_t max_piece = max_single_datatype_size - 1;
+    for (size_t offset = 0; offset < out_len; offset += max_piece) {
+      auto n = (uint8_t)std::min(max_piece, out_len - offset);
+      memcpy(piece.data(), compressed.data() + offset, n);
+      inner->write_n_bytes(n, piece);
+    }
+    inner->send();
+  }
+
+  ~DeflateStreamBuffer() override {
+    deflateEnd(&stream);
+  }
+};
+
+/**
+ * Receiving end of DeflateStreamBuffer: bytes can be fed in chunks of any
+ * size, whatever can be decoded so far is appended to the output - but
+ * only up to a given size, so a few compressed bytes can't make it grow
+ * without a bound. The rest of the input is left for the next call.
+ */
+class Inflater {
+ private:
+  static const size_t min_output_chunk = 4096;
+  z_stream stream{};
+
+ public:
+  Inflater() {
+    if (inflateInit(&stream) != Z_OK) {
+      throw CompressionException();
+    }
+  }
+
+  Inflater(const Inflater&) = delete;
+  Inflater& operator=(const Inflater&) = delete;
+
+  /**
+   * Stops once out has max_out bytes, returns how much of data was used.
+   */
+  size_t inflate(const uint8_t* data, size_t len, std::vector<uint8_t>& out,
+                 size_t max_out) {
+    stream.next_in = const_cast<uint8_t*>(data);
+    stream.avail_in = (uInt)len;
+    while (out.size() < max_out) {
+      size_t chunk =
+          std::min(std::max(min_output_chunk, 4 * len), max_out - out.size());
+      size_t old_size = out.size();
+      out.resize(old_size + chunk);
+      stream.next_out = out.data() + old_size;
+      stream.avail_out = (uInt)chunk;
+      int res = ::inflate(&stream, Z_NO_FLUSH);
+      out.resize(old_size + chunk - stream.avail_out);
+      if (res == Z_BUF_ERROR) {
+        break;  // everything given is decoded
+      }
+      if (res != Z_OK) {
+        throw CompressionException();
+      }
+      if (stream.avail_in == 0 && stream.avail_out != 0) {
+        break;
+      }
+    }
+    return len - stream.avail_in;
+  }
+
+  ~Inflater() {
+    inflateEnd(&stream);
+  }
+};
+
+#endif  // SIK_ZAD2_COMPRESSION_H
@@ -1,6 +1,7 @@
 #ifndef SIK_ZAD2_CONNECTIONUTILS_H
 #define SIK_ZAD2_CONNECTIONUTILS_H
 
+#include <optional>
 #include <string>
 
 /**
@@ -16,4 +17,22 @@ std::pair<std::string, std::string> extract_host_and_port(
   return {clean_host, clean_port};
 }
 
+/**
+ * Same-host server addresses: unix:(path) is the server's unix domain
+ * socket, shm:(path) the same socket with the shared memory ring on top.
+ * Returns the path, or nullopt for a (host):(port) address.
+ */
+std::optional<std::string> extract_local_path(const std::string& addr) {
+  for (const std::string scheme : {"unix:", "shm:"}) {
+    if (addr.starts_with(scheme)) {
+      return addr.substr(scheme.size());
+    }
+  }
+  return std::nullopt;
+}
+
+bool is_shared_ring_address(const std::string& addr) {
+  return addr.starts_with("shm:");
+}
+
 #endif  // SIK_ZAD2_CONNECTIONUTILS_H
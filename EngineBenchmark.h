@@ -0,0 +1,382 @@
+#ifndef SIK_ZAD2_ENGINEBENCHMARK_H
+#define SIK_ZAD2_ENGINEBENCHMARK_H
+
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ClientState.h"
+#include "GameEngine.h"
+#include "Message.h"
+#include "Randomizer.h"
+#include "ServerState.h"
+
+namespace po = boost::program_options;
+
+/**
+ * Every operator new of robots-bench-engine, counted in bench_engine.cpp.
+ */
+extern std::atomic<uint64_t> allocations;
+
+/**
+ * Command line options of robots-bench-engine. Every combination of a board
+ * size and a players count is a separate scenario, the bomb operations are
+ * measured for every bombs count in each.
+ * All options have defaults.
+ */
+struct BenchCommandLineOpts {
+  std::vector<uint16_t> sizes;
+  std::vector<uint16_t> players_counts;
+  std::vector<uint16_t> bombs_counts;
+  uint16_t explosion_radius{};
+  uint16_t block_density{};
+  uint16_t bomb_timer{};
+  uint16_t game_length{};
+  uint32_t min_time{};
+  uint32_t seed{};
+
+  bool parse_command_line(int argc, char *argv[]) {
+    try {
+      po::options_description desc("Opcje programu");
+      desc.add_options()
+          ("help,h", "produce help message")
+          ("size,x", po::value<std::vector<uint16_t>>(&sizes)->multitoken()
+                   ->default_value({10, 100, 1000}, "10 100 1000"),
+                   "<u16...>, board is size x size")
+          ("players-count,c",
+                   po::value<std::vector<uint16_t>>(&players_counts)
+                   ->multitoken()->default_value({1, 16}, "1 16"),
+                   "<u8...>")
+          ("bombs,B",
+                   po::value<std::vector<uint16_t>>(&bombs_counts)
+                   ->multitoken()->default_value({1, 64}, "1 64"),
+                   "<u16...>, bombs exploding in one turn")
+          ("explosion-radius,e",
+                   po::value<uint16_t>(&explosion_radius)->default_value(3),
+                   "<u16>")
+          ("block-density,k",
+                   po::value<uint16_t>(&block_density)->default_value(10),
+                   "<0-100, initial blocks as percent of the board>")
+          ("bomb-timer,b", po::value<uint16_t>(&bomb_timer)->default_value(5),
+                   "<u16, of the game whose turns are applied by the client>")
+          ("game-length,l",
+                   po::value<uint16_t>(&game_length)->default_value(200),
+                   "<u16, turns applied by the client>")
+          ("min-time,t", po::value<uint32_t>(&min_time)->default_value(200),
+                   "<u32, ms every operation is measured for at least>")
+          ("seed,s", po::value<uint32_t>(&seed)->default_value(42), "<u32>");
+
+      po::variables_map vm;
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+
+      if (vm.count("help")) {
+        std::cout << desc << "\n";
+        return false;
+      }
+      po::notify(vm);
+    } catch (std::exception &e) {
+      std::cerr << "Error: " << e.what() << "\n";
+      return false;
+    } catch (...) {
+      std::cerr << "Unknown error!"
+                << "\n";
+      return false;
+    }
+
+    for (auto size : sizes) {
+      if (size == 0) {
+        std::cerr << "Size has to be positive\n";
+        return false;
+      }
+    }
+    for (auto count : players_counts) {
+      if (count == 0 || count > UINT8_MAX) {
+        std::cerr << "Players count has to be in range 1-255\n";
+        return false;
+      }
+    }
+    for (auto count : bombs_counts) {
+      if (count == 0) {
+        std::cerr << "Bombs count has to be positive\n";
+        return false;
+      }
+    }
+    if (block_density > 100) {
+      std::cerr << "Block density is a percent\n";
+      return false;
+    }
+    if (bomb_timer == 0) {
+      std::cerr << "Bomb timer has to be positive\n";
+      return false;
+    }
+    return true;
+  }
+};
+
+/**
+ * Measures the rule engine's operations one at a time, on a state after
+ * init_game() (so with the configured block density): ns and allocations
+ * per call. Every operation is repeated in rounds until it was measured
+ * for min_time; whatever a round changes (blocks placed or destroyed,
+ * bombs) is undone between rounds, outside of the measurement.
+ * The bombs are placed with timer 1, so every check_bomb is an explosion
+ * (the expensive case). The client side applies the turns of a game
+ * played with random inputs, as robots-sim does.
+ */
+class EngineBenchmark {
+ private:
+  using clock = std::chrono::steady_clock;
+  // moves and blocks placed per round
+  static const size_t batch = 1024;
+
+  const BenchCommandLineOpts &opts;
+  std::vector<std::shared_ptr<ClientMessage>> actions;
+
+  struct Measure {
+    uint64_t ops{};
+    uint64_t allocations{};
+    clock::duration elapsed{};
+  };
+
+  struct Scenario {
+    uint16_t size;
+    uint8_t players_count;
+  };
+
+  template <typename F>
+  static void measure(Measure &m, uint64_t ops, F f) {
+    uint64_t allocations_before = allocations.load(std::memory_order_relaxed);
+    auto start = clock::now();
+    f();
+    m.elapsed += clock::now() - start;
+    m.allocations +=
+        allocations.load(std::memory_order_relaxed) - allocations_before;
+    m.ops += ops;
+  }
+
+  [[nodiscard]] bool enough(const Measure &m) const {
+    return m.elapsed >= std::chrono::milliseconds(opts.min_time);
+  }
+
+  [[nodiscard]] uint64_t requested_blocks(uint16_t size) const {
+    return (uint64_t)size * size * opts.block_density / 100;
+  }
+
+  /**
+   * Initial blocks are a u16 in the server's options, a big enough board
+   * gets fewer of them than -k asks for.
+   */
+  void warn_if_clamped(uint16_t size) const {
+    if (requested_blocks(size) <= UINT16_MAX) {
+      return;
+    }
+    std::fprintf(stderr,
+                 "Warning: %ux%u board gets %u initial blocks (%.2f%%), "
+                 "not %u%%\n",
+                 (unsigned)size, (unsigned)size, (unsigned)UINT16_MAX,
+                 100.0 * UINT16_MAX / ((double)size * size),
+                 (unsigned)opts.block_density);
+  }
+
+  [[nodiscard]] ServerCommandLineOpts make_config(const Scenario &scenario,
+                                                  uint16_t bomb_timer) const {
+    ServerCommandLineOpts config;
+    config.bomb_timer = bomb_timer;
+    config.players_count = scenario.players_count;
+    config.explosion_radius = opts.explosion_radius;
+    config.initial_blocks = (uint16_t)std::min<uint64_t>(
+        requested_blocks(scenario.size), UINT16_MAX);
+    config.game_length = opts.game_length;
+    config.server_name = "robots-bench-engine";
+    config.seed = opts.seed;
+    config.size_x = scenario.size;
+    config.size_y = scenario.size;
+
+    return config;
+  }
+
+  static void join_all(ServerState &state, uint8_t players_count) {
+    for (uint16_t i = 0; i < players_count; ++i) {
+      std::optional<PlayerId> id;
+      state.try_to_join(id, {"bot" + std::to_string(i), "[::1]:0"});
+    }
+    state.start_game();
+  }
+
+  static void print(const Scenario &scenario, const std::string &bombs,
+                    const char *operation, const Measure &m) {
+    auto ns =
+        (double)std::chrono::duration_cast<std::chrono::nanoseconds>(m.elapsed)
+            .count();
+    std::string board =
+        std::to_string(scenario.size) + "x" + std::to_string(scenario.size);
+    std::printf("%12s %8u %6s %-26s %10lu %12.1f %10.2f\n", board.c_str(),
+                (unsigned)scenario.players_count, bombs.c_str(), operation,
+                (unsigned long)m.ops, ns / (double)m.ops,
+                (double)m.allocations / (double)m.ops);
+  }
+
+  void run_server_side(const Scenario &scenario) {
+    ServerState state(make_config(scenario, 1));
+    GameEngine engine(state);
+    Randomizer rand(opts.seed + 1);
+    join_all(state, scenario.players_count);
+
+    Measure init;
+    do {
+      state.set_blocks(Board());
+      measure(init, 1, [&] { engine.init_game(); });
+    } while (!enough(init));
+    print(scenario, "-", "init_game", init);
+    const Board initial_blocks = state.get_blocks();
+
+    std::vector<std::pair<PlayerId, uint8_t>> moves(batch);
+    for (auto &[id, dir] : moves) {
+      id = (PlayerId)(rand.get_next_val() % scenario.players_count);
+      dir = (uint8_t)(rand.get_next_val() % 4);
+    }
+    Measure move;
+    do {
+      measure(move, batch, [&] {
+        for (auto [id, dir] : moves) {
+          state.move_player_in_direction(id, dir);
+        }
+      });
+    } while (!enough(move));
+    print(scenario, "-", "move_player_in_direction", move);
+
+    std::vector<Position> block_positions(batch);
+    for (auto &pos : block_positions) {
+      pos = rand.get_next_position(scenario.size, scenario.size);
+    }
+    Measure block;
+    do {
+      measure(block, batch, [&] {
+        for (auto pos : block_positions) {
+          state.place_block(pos);
+        }
+      });
+      state.set_blocks(Board(initial_blocks));
+    } while (!enough(block));
+    print(scenario, "-", "place_block", block);
+
+    for (auto bombs_count : opts.bombs_counts) {
+      run_bombs(state, rand, initial_blocks, scenario, bombs_count);
+    }
+  }
+
+  void run_bombs(ServerState &state, Randomizer &rand,
+                 const Board &initial_blocks, const Scenario &scenario,
+                 uint16_t bombs_count) {
+    std::vector<Position> bomb_positions(bombs_count);
+    for (auto &pos : bomb_positions) {
+      pos = rand.get_next_position(scenario.size, scenario.size);
+    }
+    std::vector<BombId> bomb_ids(bombs_count);
+    Measure place, check, clean_up;
+    do {
+      measure(place, bomb_ids.size(), [&] {
+        for (size_t i = 0; i < bomb_ids.size(); ++i) {
+          bomb_ids[i] = state.place_bomb(bomb_positions[i]);
+        }
+      });
+      measure(check, bomb_ids.size(), [&] {
+        for (auto id : bomb_ids) {
+          state.check_bomb(id);
+        }
+      });
+      measure(clean_up, 1, [&] { state.clean_up_bombs(); });
+      state.set_blocks(Board(initial_blocks));
+    } while (!enough(check));
+    std::string bombs = std::to_string(bombs_count);
+    print(scenario, bombs, "place_bomb", place);
+    print(scenario, bombs, "check_bomb", check);
+    print(scenario, bombs, "clean_up_bombs", clean_up);
+  }
+
+  void run_client_side(const Scenario &scenario) {
+    ServerState state(make_config(scenario, opts.bomb_timer));
+    GameEngine engine(state);
+    Randomizer input_rand(opts.seed + 1);
+    join_all(state, scenario.players_count);
+
+    ClientState initial{};
+    Hello(state).update_client_state(initial);
+    GameStarted(state).update_client_state(initial);
+    engine.init_game()->update_client_state(initial);
+
+    std::vector<std::shared_ptr<Turn>> turns;
+    std::map<PlayerId, std::shared_ptr<ClientMessage>> inputs;
+    // wider than the turn numbers, -l 65535 would wrap a u16 forever
+    for (uint32_t turn = 1; turn <= opts.game_length; ++turn) {
+      inputs.clear();
+      for (PlayerId id = 0; id < scenario.players_count; ++id) {
+        size_t action = input_rand.get_next_val() % (actions.size() + 1);
+        if (action < actions.size()) {
+          inputs[id] = actions[action];
+        }
+      }
+      turns.push_back(engine.play_turn((uint16_t)turn, inputs));
+    }
+
+    Measure apply;
+    do {
+      ClientState client = initial;
+      measure(apply, turns.size(), [&] {
+        for (auto &turn : turns) {
+          turn->update_client_state(client);
+        }
+      });
+    } while (!enough(apply));
+    print(scenario, "-", "Turn::update_client_state", apply);
+
+    for (auto bombs_count : opts.bombs_counts) {
+      std::vector<Position> explosions(bombs_count);
+      for (auto &pos : explosions) {
+        pos = input_rand.get_next_position(scenario.size, scenario.size);
+      }
+      Measure explode;
+      do {
+        measure(explode, explosions.size(), [&] {
+          for (auto pos : explosions) {
+            initial.calculate_explosions(pos);
+          }
+        });
+        initial.explosions.reset();
+      } while (!enough(explode));
+      print(scenario, std::to_string(bombs_count), "calculate_explosions",
+            explode);
+    }
+  }
+
+ public:
+  explicit EngineBenchmark(const BenchCommandLineOpts &opts) : opts(opts) {
+    for (uint8_t dir = 0; dir < 4; ++dir) {
+      actions.push_back(std::make_shared<ClientMove>(dir));
+    }
+    actions.push_back(std::make_shared<ClientPlaceBomb>());
+    actions.push_back(std::make_shared<ClientPlaceBlock>());
+  }
+
+  void run() {
+    std::printf("%12s %8s %6s %-26s %10s %12s %10s\n", "board", "players",
+                "bombs", "operation", "ops", "ns/op", "allocs/op");
+    for (auto size : opts.sizes) {
+      warn_if_clamped(size);
+      for (auto players_count : opts.players_counts) {
+        Scenario scenario{size, (uint8_t)players_count};
+        run_server_side(scenario);
+        run_client_side(scenario);
+      }
+    }
+  }
+};
+
+#endif  // SIK_ZAD2_ENGINEBENCHMARK_H
@@ -0,0 +1,171 @@
+#ifndef SIK_ZAD2_GAMEENGINE_H
+#define SIK_ZAD2_GAMEENGINE_H
+
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "Board.h"
+#include "Message.h"
+#include "MessageUtils.h"
+#include "ServerState.h"
+
+/**
+ * Everything turn 0 of a game consists of, computed in advance from a copy
+ * of the random generator. Ids of players are always 0 ... players_count - 1
+ * at game start, so it doesn't depend on who joins.
+ */
+struct PreparedGame {
+  // generator state the game was prepared for and the one after turn 0
+  Randomizer rand_before;
+  Randomizer rand_after;
+  std::map<PlayerId, Position> positions;
+  Board blocks;
+  std::shared_ptr<Turn> init_turn;
+};
+
+/**
+ * Game rules without any networking or timing.
+ * Given a ServerState (configuration, seed and joined players) it produces
+ * Turn events - turn 0 from init_game() and every next one from play_turn().
+ * It does not lock anything, the caller is responsible for making sure no one
+ * touches the state in the meantime (the Server holds client_messages lock,
+ * headless users simply don't share the state).
+ */
+class GameEngine {
+ private:
+  ServerState &state;
+
+ public:
+  explicit GameEngine(ServerState &state) : state(state){};
+
+  /**
+   * Initial players' and blocks' positions are chosen and turn 0 is prepared.
+   * After we choose the position, we make changes in the state and add
+   * a matching event to turn 0.
+   */
+  std::shared_ptr<Turn> init_game() {
+    std::shared_ptr<Turn> init_turn = std::make_shared<Turn>(0);
+
+    auto roster = state.get_roster();
+    for (auto &player : *roster) {
+      Position init_pos = state.get_rand().get_next_position(
+          state.get_size_x(), state.get_size_y());
+
+      state.move_player(player.id, init_pos);
+      init_turn->addEvent(std::make_shared<PlayerMoved>(player.id, init_pos));
+    }
+
+    for (uint16_t i = 0; i < state.get_initial_blocks(); ++i) {
+      Position init_pos = state.get_rand().get_next_position(
+          state.get_size_x(), state.get_size_y());
+
+      if (state.place_block(init_pos)) {
+        init_turn->addEvent(std::make_shared<BlockPlaced>(init_pos));
+      }
+    }
+
+    return init_turn;
+  }
+
+  /**
+   * Computes turn 0 of the next game, the same way init_game() does, but
+   * without touching the state - it only reads the configuration, so it can
+   * be done on another thread while the current game is still running.
+   * rand has to be the generator state after the current game's last turn.
+   */
+  [[nodiscard]] PreparedGame prepare_game(Randomizer rand) const {
+    PreparedGame prepared{rand, rand, {}, {}, std::make_shared<Turn>(0)};
+
+    for (PlayerId id = 0; id < state.get_players_count(); ++id) {
+      Position init_pos = prepared.rand_after.get_next_position(
+          state.get_size_x(), state.get_size_y());
+
+      prepared.positions[id] = init_pos;
+      prepared.init_turn->addEvent(std::make_shared<PlayerMoved>(id, init_pos));
+    }
+
+    for (uint16_t i = 0; i < state.get_initial_blocks(); ++i) {
+      Position init_pos = prepared.rand_after.get_next_position(
+          state.get_size_x(), state.get_size_y());
+
+      if (prepared.blocks.insert(init_pos)) {
+        prepared.init_turn->addEvent(std::make_shared<BlockPlaced>(init_pos));
+      }
+    }
+
+    return prepared;
+  }
+
+  /**
+   * Starts the game from a prepared turn 0. If it was prepared for
+   * a different generator state (so it would differ from what init_game()
+   * does), it is thrown away and turn 0 is computed now.
+   */
+  std::shared_ptr<Turn> init_game(PreparedGame &&prepared) {
+    if (!(prepared.rand_before == state.get_rand()) ||
+        prepared.positions.size() != state.get_roster()->size()) {
+      return init_game();
+    }
+
+    for (auto &[id, pos] : prepared.positions) {
+      state.move_player(id, pos);
+    }
+    state.set_blocks(std::move(prepared.blocks));
+    state.get_rand() = prepared.rand_after;
+
+    return prepared.init_turn;
+  }
+
+  /**
+   * Here is the course of one round.
+   * First it is calculated which bombs have exploded, which players have died
+   * and which blocks were destroyed and after all of that, messages from
+   * players that survived (collected in the state) are being processed.
+   */
+  std::shared_ptr<Turn> play_turn(uint16_t turn_num) {
+    TRACE_SPAN("play_turn");
+    std::shared_ptr<Turn> cur_turn = std::make_shared<Turn>(turn_num);
+
+    for (auto [id, bomb] : state.get_bombs()) {
+      auto opt_val = state.check_bomb(id);
+      if (opt_val) {
+        auto [a, b] = *opt_val;
+        cur_turn->addEvent(std::make_shared<BombExploded>(id, b, a));
+      }
+    }
+
+    auto dead_players = state.clean_up_bombs();
+
+    for (auto [id, msg] : state.get_messages_from_turn_no_sync()) {
+      if (!dead_players.contains(id) && msg) {
+        msg->update_server_state(state, id, cur_turn);
+      } else if (dead_players.contains(id)) {
+        Position new_pos = state.get_rand().get_next_position(
+            state.get_size_x(), state.get_size_y());
+
+        state.move_player(id, new_pos);
+        cur_turn->addEvent(std::make_shared<PlayerMoved>(id, new_pos));
+      }
+    }
+    state.reset_messages_from_players_no_sync();
+
+    return cur_turn;
+  }
+
+  /**
+   * Same as above, but with this turn's inputs given explicitly
+   * (at most one message per player, as on the server).
+   */
+  std::shared_ptr<Turn> play_turn(
+      uint16_t turn_num,
+      const std::map<PlayerId, std::shared_ptr<ClientMessage>> &inputs) {
+    auto &messages = state.get_messages_from_turn_no_sync();
+    for (auto &[id, msg] : inputs) {
+      messages[id] = msg;
+    }
+    return play_turn(turn_num);
+  }
+};
+
+#endif  // SIK_ZAD2_GAMEENGINE_H
@@ -0,0 +1,212 @@
+#ifndef SIK_ZAD2_IOURING_H
+#define SIK_ZAD2_IOURING_H
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+/**
+ * Minimal io_uring (raw syscalls, no liburing) used only to write to many
+ * sockets at once: sends are queued with add_send() and submit() passes
+ * them all to the kernel and waits for all of them in one io_uring_enter.
+ * The sends are independent (not linked), so one broken connection doesn't
+ * cancel the others'.
+ */
+class IoUringSender {
+ private:
+  int ring_fd;
+  unsigned entries{};
+  void* sq_ring{};
+  size_t sq_ring_size{};
+  void* cq_ring{};
+  size_t cq_ring_size{};
+  io_uring_sqe* sqes{};
+  size_t sqes_size{};
+
+  unsigned* sq_tail{};
+  unsigned* sq_mask{};
+  unsigned* sq_array{};
+  unsigned* cq_head{};
+  unsigned* cq_tail{};
+  unsigned* cq_mask{};
+  io_uring_cqe* cqes{};
+
+  // queued, not submitted yet
+  unsigned queued{};
+  // of the current submit(), in user_data above the send's index - sends
+  // an earlier submit() gave up on may still complete, those are dropped
+  uint32_t generation{};
+
+  static void* map(int fd, size_t size, off_t offset) {
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, offset);
+    return memory == MAP_FAILED ? nullptr : memory;
+  }
+
+  explicit IoUringSender(int ring_fd) : ring_fd(ring_fd) {
+  }
+
+  bool setup(const io_uring_params& params) {
+    entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    sq_ring = map(ring_fd, sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = map(ring_fd, cq_ring_size, IORING_OFF_CQ_RING);
+    sqes = static_cast<io_uring_sqe*>(map(ring_fd, sqes_size, IORING_OFF_SQES));
+    if (!sq_ring || !cq_ring || !sqes) {
+      return false;
+    }
+
+    auto* sq = static_cast<uint8_t*>(sq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    auto* cq = static_cast<uint8_t*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  int enter(unsigned to_submit, unsigned min_complete) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                        IORING_ENTER_GETEVENTS, nullptr, 0);
+  }
+
+ public:
+  /**
+   * Returns nullptr if io_uring is not available (old kernel, disabled
+   * by sysctl or seccomp).
+   */
+  static std::unique_ptr<IoUringSender> create(unsigned entries) {
+    io_uring_params params{};
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+      return nullptr;
+    }
+    std::unique_ptr<IoUringSender> sender(new IoUringSender(fd));
+    if (!sender->setup(params)) {
+      return nullptr;
+    }
+    return sender;
+  }
+
+  IoUringSender(const IoUringSender&) = delete;
+  IoUringSender& operator=(const IoUringSender&) = delete;
+
+  /**
+   * How many sends fit in one submit().
+   */
+  [[nodiscard]] unsigned capacity() const {
+    return entries;
+  }
+
+  /**
+   * Queues writing all of data to the socket, its result will be at index
+   * (the number of sends queued before it) in what submit() returns.
+   * The data has to stay there until submit() returns.
+   */
+  void add_send(int fd, const uint8_t* data, size_t len) {
+    unsigned tail = *sq_tail + queued;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)generation << 32 | queued;
+    sq_array[index] = index;
+    queued++;
+  }
+
+  /**
+   * Submits everything queued and waits until all of it is done. Returns
+   * bytes sent (or -errno) of every send, in the order they were queued.
+   * If the kernel refuses to take the sends, the ones it hasn't taken are
+   * taken back (and fail with that errno) and the ones it has are still
+   * waited for, so their data isn't freed under them.
+   */
+  std::vector<int> submit() {
+    std::vector<int> results(queued, -ECANCELED);
+    if (queued == 0) {
+      return results;
+    }
+    std::atomic_ref<unsigned>(*sq_tail).store(*sq_tail + queued,
+                                              std::memory_order_release);
+    unsigned to_submit = queued;
+    unsigned left = queued;
+    queued = 0;
+    bool refused = false;
+
+    while (left > 0) {
+      int taken = enter(to_submit, left);
+      if (taken >= 0) {
+        to_submit -= std::min((unsigned)taken, to_submit);
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        if (refused) {
+          // can't even wait any more, the rest is dropped when it completes
+          break;
+        }
+        refused = true;
+        int error = errno;
+        std::atomic_ref<unsigned>(*sq_tail).store(*sq_tail - to_submit,
+                                                  std::memory_order_release);
+        for (unsigned i = (unsigned)results.size() - to_submit;
+             i < results.size(); ++i) {
+          results[i] = -error;
+        }
+        left -= to_submit;
+        to_submit = 0;
+      }
+      unsigned head = *cq_head;
+      unsigned tail =
+          std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire);
+      for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        if (cqe.user_data >> 32 == generation) {
+          results[(uint32_t)cqe.user_data] = cqe.res;
+          --left;
+        }
+      }
+      std::atomic_ref<unsigned>(*cq_head).store(head,
+                                                std::memory_order_release);
+    }
+    ++generation;
+    return results;
+  }
+
+  ~IoUringSender() {
+    if (sqes) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring) {
+      munmap(sq_ring, sq_ring_size);
+    }
+    close(ring_fd);
+  }
+};
+
+#endif  // __linux__
+
+#endif  // SIK_ZAD2_IOURING_H
@@ -0,0 +1,529 @@
+#ifndef SIK_ZAD2_LATENCYBENCHMARK_H
+#define SIK_ZAD2_LATENCYBENCHMARK_H
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Buffer.h"
+#include "ByteStream.h"
+#include "MessageUtils.h"
+#include "Randomizer.h"
+
+namespace po = boost::program_options;
+
+extern char **environ;
+
+/**
+ * Command line options of robots-bench-latency. Every combination of a turn
+ * duration and a players count is a separate scenario (a separate server
+ * and clients). All options have defaults.
+ */
+struct LatencyCommandLineOpts {
+  std::string server_path;
+  std::string client_path;
+  std::vector<uint64_t> turn_durations;
+  std::vector<uint16_t> players_counts;
+  std::vector<std::string> client_args;
+  uint16_t game_length{};
+  uint16_t size{};
+  uint16_t initial_blocks{};
+  uint16_t bomb_timer{};
+  uint16_t bomb_percent{};
+  uint16_t port{};
+  uint32_t seed{};
+
+  bool parse_command_line(int argc, char *argv[]) {
+    try {
+      po::options_description desc("Opcje programu");
+      desc.add_options()
+          ("help,h", "produce help message")
+          ("server", po::value<std::string>(&server_path)
+                   ->default_value("./robots-server"), "<path>")
+          ("client", po::value<std::string>(&client_path)
+                   ->default_value("./robots-client"), "<path>")
+          ("turn-duration,d",
+                   po::value<std::vector<uint64_t>>(&turn_durations)
+                   ->multitoken()->default_value({20, 50, 100}, "20 50 100"),
+                   "<u64...>, ms")
+          ("players-count,c",
+                   po::value<std::vector<uint16_t>>(&players_counts)
+                   ->multitoken()->default_value({1, 4, 16}, "1 4 16"),
+                   "<u8...>, every player is a robots-client with a fake GUI")
+          ("client-arg", po::value<std::vector<std::string>>(&client_args)
+                   ->composing(),
+                   "<string, passed to every robots-client, e.g. "
+                   "--client-arg=--predict, can be given many times>")
+          ("game-length,l",
+                   po::value<uint16_t>(&game_length)->default_value(100),
+                   "<u16>")
+          ("size,x", po::value<uint16_t>(&size)->default_value(20),
+                   "<u16, board is size x size>")
+          ("initial-blocks,k",
+                   po::value<uint16_t>(&initial_blocks)->default_value(20),
+                   "<u16>")
+          ("bomb-timer,b", po::value<uint16_t>(&bomb_timer)->default_value(5),
+                   "<u16>")
+          ("bomb-percent", po::value<uint16_t>(&bomb_percent)
+                   ->default_value(10),
+                   "<0-100, inputs that are PlaceBomb, the rest is Move>")
+          ("port,p", po::value<uint16_t>(&port)->default_value(31000),
+                   "<u16, first of the ports used (server, clients)>")
+          ("seed,s", po::value<uint32_t>(&seed)->default_value(42), "<u32>");
+
+      po::variables_map vm;
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+
+      if (vm.count("help")) {
+        std::cout << desc << "\n";
+        return false;
+      }
+      po::notify(vm);
+    } catch (std::exception &e) {
+      std::cerr << "Error: " << e.what() << "\n";
+      return false;
+    } catch (...) {
+      std::cerr << "Unknown error!"
+                << "\n";
+      return false;
+    }
+
+    for (auto count : players_counts) {
+      if (count == 0 || count > UINT8_MAX) {
+        std::cerr << "Players count has to be in range 1-255\n";
+        return false;
+      }
+    }
+    for (auto duration : turn_durations) {
+      if (duration == 0) {
+        std::cerr << "Turn duration has to be positive\n";
+        return false;
+      }
+    }
+    if (bomb_percent > 100) {
+      std::cerr << "Bomb percent is a percent\n";
+      return false;
+    }
+    if (size == 0 || bomb_timer == 0) {
+      std::cerr << "Size and bomb timer have to be positive\n";
+      return false;
+    }
+    return true;
+  }
+};
+
+/**
+ * Child process (robots-server or robots-client), terminated and waited
+ * for when destroyed. Its output goes where ours does.
+ */
+class ChildProcess {
+ private:
+  pid_t pid{};
+
+ public:
+  explicit ChildProcess(const std::vector<std::string> &args) {
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    if (posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) !=
+        0) {
+      throw std::runtime_error("Cannot start " + args[0]);
+    }
+  }
+
+  ChildProcess(const ChildProcess &) = delete;
+  ChildProcess &operator=(const ChildProcess &) = delete;
+
+  ~ChildProcess() {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+};
+
+/**
+ * Stand-in for the GUI of one robots-client. It joins the game, then sends
+ * one input at a time, at a random moment of a turn, and measures how long
+ * it takes until a Game datagram shows its effect: the robot on the next
+ * field (Move, always in a free direction) or a new bomb under it
+ * (PlaceBomb). An input that doesn't show up within max_wait_turns turns
+ * (e.g. the robot died in the meantime) counts as lost.
+ */
+class FakeGui {
+ public:
+  using clock = std::chrono::steady_clock;
+
+ private:
+  static const uint16_t max_wait_turns = 4;
+  using udp = boost::asio::ip::udp;
+
+  const LatencyCommandLineOpts &opts;
+  const std::string name;
+  const uint64_t turn_duration;
+  udp::socket socket;
+  udp::endpoint client_endpoint;
+  boost::asio::steady_timer input_timer;
+  Randomizer rand;
+  std::array<uint8_t, 65536> datagram{};
+
+  // from the last Game
+  std::optional<PlayerId> id;
+  uint16_t turn{};
+  Position position;
+  std::set<Position> blocks;
+  std::vector<Bomb> bombs;
+
+  struct Pending {
+    clock::time_point sent;
+    uint16_t sent_turn;
+    bool bomb;
+    Position expected;
+  };
+  std::optional<Pending> pending;
+  bool input_scheduled{};
+  bool game_seen{};
+
+  static std::optional<Position> step(Position pos, uint8_t dir,
+                                      uint16_t size) {
+    switch (dir) {
+      case 0:
+        pos.y++;
+        break;
+      case 1:
+        pos.x++;
+        break;
+      case 2:
+        pos.y--;
+        break;
+      default:
+        pos.x--;
+        break;
+    }
+    if (pos.x >= size || pos.y >= size) {
+      return {};  // negative coordinates wrap around to >= size
+    }
+    return pos;
+  }
+
+  void send_input(std::vector<uint8_t> input) {
+    socket.send_to(boost::asio::buffer(input), client_endpoint);
+  }
+
+  [[nodiscard]] bool has_new_bomb_at(Position pos) const {
+    return std::any_of(bombs.begin(), bombs.end(), [&](const Bomb &bomb) {
+      return bomb.position == pos && bomb.timer == opts.bomb_timer;
+    });
+  }
+
+  void make_input() {
+    input_scheduled = false;
+    if (done || !id) {
+      return;
+    }
+    std::vector<uint8_t> free_directions;
+    for (uint8_t dir = 0; dir < 4; ++dir) {
+      auto next = step(position, dir, opts.size);
+      if (next && !blocks.contains(*next)) {
+        free_directions.push_back(dir);
+      }
+    }
+    bool bomb = free_directions.empty() ||
+                rand.get_next_val() % 100 < opts.bomb_percent;
+    if (bomb && has_new_bomb_at(position)) {
+      bomb = false;  // wouldn't be told apart from the one already there
+      if (free_directions.empty()) {
+        schedule_input();
+        return;
+      }
+    }
+
+    pending = Pending{clock::now(), turn, bomb, position};
+    if (bomb) {
+      send_input({0});
+    } else {
+      uint8_t dir =
+          free_directions[rand.get_next_val() % free_directions.size()];
+      pending->expected = *step(position, dir, opts.size);
+      send_input({2, dir});
+    }
+  }
+
+  void schedule_input() {
+    if (input_scheduled) {
+      return;
+    }
+    input_scheduled = true;
+    input_timer.expires_after(std::chrono::microseconds(
+        rand.get_next_val() % (turn_duration * 1000)));
+    input_timer.async_wait([this](const boost::system::error_code &error) {
+      if (!error) {
+        make_input();
+      }
+    });
+  }
+
+  void handle_game(ByteStream &stream) {
+    std::string server_name;
+    uint16_t size_x, size_y, game_length;
+    std::map<PlayerId, Player> players;
+    std::map<PlayerId, Position> positions;
+    std::vector<Position> blocks_list;
+    stream >> server_name >> size_x >> size_y >> game_length >> turn >>
+        players >> positions >> blocks_list >> bombs;
+    game_seen = true;
+
+    for (auto &[player_id, player] : players) {
+      if (player.name == name) {
+        id = player_id;
+      }
+    }
+    if (!id || !positions.contains(*id)) {
+      return;
+    }
+    position = positions[*id];
+    blocks = std::set<Position>(blocks_list.begin(), blocks_list.end());
+
+    if (pending) {
+      bool shown = pending->bomb ? has_new_bomb_at(pending->expected)
+                                 : position == pending->expected;
+      if (shown) {
+        latencies.push_back(clock::now() - pending->sent);
+        pending.reset();
+      } else if (turn >= pending->sent_turn + max_wait_turns) {
+        lost++;
+        pending.reset();
+      }
+    }
+    if (!pending) {
+      schedule_input();
+    }
+  }
+
+  void handle_lobby(ByteStream &stream) {
+    if (game_seen) {
+      done = true;  // the game is over
+      input_timer.cancel();
+      return;
+    }
+    std::string server_name;
+    uint8_t players_count;
+    uint16_t size_x, size_y, game_length, explosion_radius, bomb_timer;
+    std::map<PlayerId, Player> players;
+    stream >> server_name >> players_count >> size_x >> size_y >>
+        game_length >> explosion_radius >> bomb_timer >> players;
+    bool joined = std::any_of(players.begin(), players.end(), [&](auto &p) {
+      return p.second.name == name;
+    });
+    if (!joined) {
+      send_input({0});  // any input in the lobby is Join
+    }
+  }
+
+  void receive() {
+    socket.async_receive(
+        boost::asio::buffer(datagram),
+        [this](const boost::system::error_code &error, size_t bytes) {
+          if (error) {
+            return;
+          }
+          auto *buffer = new MemoryStreamBuffer();
+          ByteStream stream((std::unique_ptr<StreamBuffer>(buffer)));
+          buffer->set_input(datagram.data(), bytes);
+          try {
+            uint8_t message_id;
+            stream >> message_id;
+            if (message_id == 0) {
+              handle_lobby(stream);
+            } else if (message_id == 1) {
+              handle_game(stream);
+            }
+          } catch (std::exception &e) {
+            std::cerr << name << ": " << e.what() << std::endl;
+          }
+          if (!done) {
+            receive();
+          }
+        });
+  }
+
+ public:
+  std::vector<clock::duration> latencies;
+  uint64_t lost{};
+  bool done{};
+
+  FakeGui(boost::asio::io_context &io_context,
+          const LatencyCommandLineOpts &opts, std::string name,
+          uint64_t turn_duration, uint16_t client_port, uint32_t seed)
+      : opts(opts),
+        name(std::move(name)),
+        turn_duration(turn_duration),
+        socket(io_context,
+               udp::endpoint(boost::asio::ip::address_v6::loopback(), 0)),
+        client_endpoint(boost::asio::ip::address_v6::loopback(), client_port),
+        input_timer(io_context),
+        rand(seed) {
+    receive();
+  }
+
+  [[nodiscard]] uint16_t get_port() const {
+    return socket.local_endpoint().port();
+  }
+};
+
+/**
+ * Runs a server and players_count clients with fake GUIs on loopback for
+ * one game per scenario and reports the distribution of the latency from
+ * a GUI input to the Game datagram that shows its effect - what a player
+ * sees (input -> client -> server -> Turn -> client -> GUI, including
+ * waiting for the turn to end).
+ */
+class LatencyBenchmark {
+ private:
+  using clock = FakeGui::clock;
+
+  const LatencyCommandLineOpts &opts;
+  uint16_t next_port;
+
+  static bool wait_for_server(uint16_t port) {
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::address_v6::loopback(), port);
+    for (int attempt = 0; attempt < 50; ++attempt) {
+      boost::asio::ip::tcp::socket socket(io_context);
+      boost::system::error_code error;
+      socket.connect(endpoint, error);
+      if (!error) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return false;
+  }
+
+  static double ms(clock::duration d) {
+    return (double)std::chrono::duration_cast<std::chrono::microseconds>(d)
+               .count() /
+           1000.0;
+  }
+
+  void run_scenario(uint64_t turn_duration, uint8_t players_count) {
+    uint16_t server_port = next_port;
+    next_port = (uint16_t)(next_port + players_count + 1);
+
+    ChildProcess server({opts.server_path, "-b",
+                         std::to_string(opts.bomb_timer), "-c",
+                         std::to_string(players_count), "-d",
+                         std::to_string(turn_duration), "-e", "2", "-k",
+                         std::to_string(opts.initial_blocks), "-l",
+                         std::to_string(opts.game_length), "-n",
+                         "robots-bench-latency", "-p",
+                         std::to_string(server_port), "-s",
+                         std::to_string(opts.seed), "-x",
+                         std::to_string(opts.size), "-y",
+                         std::to_string(opts.size)});
+    if (!wait_for_server(server_port)) {
+      std::cerr << "Server didn't start" << std::endl;
+      return;
+    }
+
+    boost::asio::io_context io_context;
+    std::vector<std::unique_ptr<FakeGui>> guis;
+    std::vector<std::unique_ptr<ChildProcess>> clients;
+    for (uint16_t i = 0; i < players_count; ++i) {
+      auto client_port = (uint16_t)(server_port + 1 + i);
+      std::string name = "bot" + std::to_string(i);
+      guis.push_back(std::make_unique<FakeGui>(io_context, opts, name,
+                                               turn_duration, client_port,
+                                               opts.seed + i));
+      std::vector<std::string> args{
+          opts.client_path,
+          "-d",
+          "::1:" + std::to_string(guis.back()->get_port()),
+          "-n",
+          name,
+          "-p",
+          std::to_string(client_port),
+          "-s",
+          "::1:" + std::to_string(server_port)};
+      args.insert(args.end(), opts.client_args.begin(),
+                  opts.client_args.end());
+      clients.push_back(std::make_unique<ChildProcess>(args));
+    }
+
+    // the game, and some time for everyone to connect and join
+    auto deadline = clock::now() +
+                    std::chrono::milliseconds(turn_duration *
+                                              (opts.game_length + 10)) +
+                    std::chrono::seconds(10);
+    while (clock::now() < deadline &&
+           std::any_of(guis.begin(), guis.end(),
+                       [](auto &gui) { return !gui->done; })) {
+      io_context.run_for(std::chrono::milliseconds(100));
+    }
+
+    std::vector<clock::duration> latencies;
+    uint64_t lost = 0;
+    for (auto &gui : guis) {
+      latencies.insert(latencies.end(), gui->latencies.begin(),
+                       gui->latencies.end());
+      lost += gui->lost;
+    }
+    print(turn_duration, players_count, latencies, lost);
+  }
+
+  static void print(uint64_t turn_duration, uint8_t players_count,
+                    std::vector<clock::duration> &latencies, uint64_t lost) {
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+      return ms(latencies[(size_t)(p * (double)(latencies.size() - 1))]);
+    };
+    if (latencies.empty()) {
+      std::printf("%8lu %8u %8u %8lu %8s\n", (unsigned long)turn_duration,
+                  (unsigned)players_count, 0u, (unsigned long)lost, "-");
+      return;
+    }
+    clock::duration sum{};
+    for (auto latency : latencies) {
+      sum += latency;
+    }
+    std::printf("%8lu %8u %8lu %8lu %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+                (unsigned long)turn_duration, (unsigned)players_count,
+                (unsigned long)latencies.size(), (unsigned long)lost,
+                percentile(0), percentile(0.5), percentile(0.9),
+                percentile(0.99), percentile(1),
+                ms(sum) / (double)latencies.size());
+  }
+
+ public:
+  explicit LatencyBenchmark(const LatencyCommandLineOpts &opts)
+      : opts(opts), next_port(opts.port) {
+  }
+
+  void run() {
+    std::printf("%8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "turn[ms]",
+                "players", "inputs", "lost", "min", "p50", "p90", "p99", "max",
+                "mean");
+    for (auto turn_duration : opts.turn_durations) {
+      for (auto players_count : opts.players_counts) {
+        run_scenario(turn_duration, (uint8_t)players_count);
+      }
+    }
+  }
+};
+
+#endif  // SIK_ZAD2_LATENCYBENCHMARK_H
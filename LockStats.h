@@ -0,0 +1,421 @@
+#ifndef SIK_ZAD2_LOCKSTATS_H
+#define SIK_ZAD2_LOCKSTATS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "Trace.h"
+
+/**
+ * Contention statistics of the server's locks and conditions, per site -
+ * the code that takes them, named by a Site object on the calling thread's
+ * stack (innermost wins, "other" if there is none). For locks it counts
+ * acquisitions and how many had to wait, with histograms of the wait and
+ * of the hold time; for conditions the waits that blocked, wakeups (also
+ * spurious - the predicate was still false) and notifies, with a histogram
+ * of the time blocked. Collected only while enabled (robots-server
+ * --lock-stats), otherwise a lock costs one relaxed load more.
+ */
+namespace lock_stats {
+
+inline std::atomic<bool> enabled_flag{};
+
+inline bool enabled() {
+  return enabled_flag.load(std::memory_order_relaxed);
+}
+
+inline thread_local const char* current_site = "other";
+
+/**
+ * Locks taken while it exists are counted as taken by name (a literal).
+ */
+class Site {
+ private:
+  const char* previous;
+
+ public:
+  explicit Site(const char* name) : previous(current_site) {
+    current_site = name;
+  }
+
+  Site(const Site&) = delete;
+  Site& operator=(const Site&) = delete;
+
+  ~Site() {
+    current_site = previous;
+  }
+};
+
+/**
+ * Durations in power of two buckets: bucket b has [2^(b-1), 2^b) ns
+ * (bucket 0 - zero). Percentiles are the upper bounds of buckets.
+ */
+class Histogram {
+ private:
+  static const size_t buckets = 48;
+  std::array<std::atomic<uint64_t>, buckets> counts{};
+  std::atomic<uint64_t> total{};
+  std::atomic<uint64_t> max_ns{};
+
+ public:
+  void add(uint64_t ns) {
+    size_t bucket = std::min((size_t)std::bit_width(ns), buckets - 1);
+    counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns.compare_exchange_weak(max, ns)) {
+    }
+  }
+
+  [[nodiscard]] uint64_t count() const {
+    return total.load(std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] uint64_t percentile_ns(double p) const {
+    auto wanted = (uint64_t)(p * (double)count());
+    uint64_t seen = 0;
+    uint64_t max = max_ns.load(std::memory_order_relaxed);
+    for (size_t bucket = 0; bucket < buckets; ++bucket) {
+      seen += counts[bucket].load(std::memory_order_relaxed);
+      if (seen > wanted) {
+        return std::min(bucket == 0 ? 0 : (uint64_t)1 << bucket, max);
+      }
+    }
+    return max;
+  }
+
+  /**
+   * p50/p99/max in us.
+   */
+  void print(std::ostream& os) const {
+    char line[64];
+    std::snprintf(line, sizeof(line), "%10.1f %10.1f %10.1f",
+                  (double)percentile_ns(0.5) / 1000,
+                  (double)percentile_ns(0.99) / 1000,
+                  (double)max_ns.load(std::memory_order_relaxed) / 1000);
+    os << line;
+  }
+};
+
+struct SiteStats {
+  std::atomic<const char*> site{};
+  Histogram wait;
+  Histogram hold;
+  std::atomic<uint64_t> contended{};
+  std::atomic<uint64_t> wakeups{};
+  std::atomic<uint64_t> spurious{};
+  std::atomic<uint64_t> notifies{};
+};
+
+class LockStats;
+
+/**
+ * Every lock and condition, for dumps.
+ */
+class Registry {
+ private:
+  std::mutex mutex;
+  std::vector<const LockStats*> all;
+
+ public:
+  void add(const LockStats* stats) {
+    std::lock_guard lk(mutex);
+    all.push_back(stats);
+  }
+
+  void remove(const LockStats* stats) {
+    std::lock_guard lk(mutex);
+    all.erase(std::find(all.begin(), all.end(), stats));
+  }
+
+  void dump(std::ostream& os);
+};
+
+inline Registry registry;
+
+/**
+ * Statistics of one lock or condition. Sites are kept in fixed tables
+ * (found or claimed without locking), once they are full the rest is
+ * counted in the last entry.
+ */
+class LockStats {
+ public:
+  using clock = std::chrono::steady_clock;
+
+ private:
+  static const size_t max_sites = 16;
+  using Sites = std::array<SiteStats, max_sites>;
+
+  struct Held {
+    const LockStats* lock;
+    clock::time_point since;
+    SiteStats* stats;
+  };
+  // locks the thread holds (this way a shared lock's hold time is known)
+  static inline thread_local std::vector<Held> held;
+
+  const char* name;
+  bool condition;
+  Sites exclusive_sites;
+  Sites shared_sites;
+
+  static uint64_t ns(clock::duration d) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d)
+        .count();
+  }
+
+  static SiteStats& for_site(Sites& sites) {
+    const char* site = current_site;
+    for (auto& stats : sites) {
+      const char* claimed = stats.site.load(std::memory_order_acquire);
+      if (!claimed && stats.site.compare_exchange_strong(
+                          claimed, site, std::memory_order_acq_rel)) {
+        return stats;
+      }
+      if (claimed == site || std::strcmp(claimed, site) == 0) {
+        return stats;
+      }
+    }
+    return sites.back();
+  }
+
+  void print_lock_sites(std::ostream& os, const Sites& sites,
+                        const char* mode) const {
+    char line[128];
+    for (auto& stats : sites) {
+      const char* site = stats.site.load(std::memory_order_acquire);
+      if (!site || stats.wait.count() == 0) {
+        continue;
+      }
+      std::snprintf(line, sizeof(line), "  %-22s %-4s %10lu %10lu ", site,
+                    mode, (unsigned long)stats.wait.count(),
+                    (unsigned long)stats.contended.load());
+      os << line;
+      stats.wait.print(os);
+      os << ' ';
+      stats.hold.print(os);
+      os << '\n';
+    }
+  }
+
+ public:
+  LockStats(const char* name, bool condition)
+      : name(name), condition(condition) {
+    registry.add(this);
+  }
+
+  LockStats(const LockStats&) = delete;
+  LockStats& operator=(const LockStats&) = delete;
+
+  ~LockStats() {
+    registry.remove(this);
+  }
+
+  void acquired(bool shared, clock::duration wait, bool was_contended) {
+    SiteStats& stats = for_site(shared ? shared_sites : exclusive_sites);
+    stats.wait.add(ns(wait));
+    if (was_contended) {
+      stats.contended.fetch_add(1, std::memory_order_relaxed);
+    }
+    held.push_back({this, clock::now(), &stats});
+  }
+
+  void released() {
+    for (auto it = held.rbegin(); it != held.rend(); ++it) {
+      if (it->lock == this) {
+        it->stats->hold.add(ns(clock::now() - it->since));
+        held.erase(std::next(it).base());
+        return;
+      }
+    }
+  }
+
+  void waited(clock::duration wait, uint64_t wakeups) {
+    SiteStats& stats = for_site(exclusive_sites);
+    stats.wait.add(ns(wait));
+    stats.wakeups.fetch_add(wakeups, std::memory_order_relaxed);
+    stats.spurious.fetch_add(wakeups - 1, std::memory_order_relaxed);
+  }
+
+  void notified() {
+    for_site(exclusive_sites).notifies.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void print(std::ostream& os) const {
+    char line[128];
+    if (!condition) {
+      std::snprintf(line, sizeof(line), "%-27s %10s %10s %32s %32s\n", name,
+                    "acquired", "contended", "wait p50/p99/max [us]",
+                    "hold p50/p99/max [us]");
+      os << line;
+      print_lock_sites(os, exclusive_sites, "excl");
+      print_lock_sites(os, shared_sites, "shar");
+      return;
+    }
+    std::snprintf(line, sizeof(line), "%-24s %10s %10s %10s %10s %32s\n",
+                  name, "waits", "wakeups", "spurious", "notifies",
+                  "blocked p50/p99/max [us]");
+    os << line;
+    for (auto& stats : exclusive_sites) {
+      const char* site = stats.site.load(std::memory_order_acquire);
+      if (!site) {
+        continue;
+      }
+      std::snprintf(line, sizeof(line), "  %-22s %10lu %10lu %10lu %10lu ",
+                    site, (unsigned long)stats.wait.count(),
+                    (unsigned long)stats.wakeups.load(),
+                    (unsigned long)stats.spurious.load(),
+                    (unsigned long)stats.notifies.load());
+      os << line;
+      stats.wait.print(os);
+      os << '\n';
+    }
+  }
+};
+
+inline void Registry::dump(std::ostream& os) {
+  std::lock_guard lk(mutex);
+  for (auto* stats : all) {
+    stats->print(os);
+  }
+  os.flush();
+}
+
+}  // namespace lock_stats
+
+/**
+ * Mutex that shows up in the trace (as a span named name) when a thread
+ * has to wait for it - only then, an uncontended lock is one try_lock -
+ * and in lock_stats.
+ */
+template <typename Mutex>
+class TracedMutex {
+ private:
+  using clock = lock_stats::LockStats::clock;
+
+  Mutex mutex;
+  [[maybe_unused]] const char* name;
+  lock_stats::LockStats stats;
+
+  template <typename TryLock, typename Lock>
+  void acquire(bool shared, TryLock try_lock, Lock lock) {
+    if (try_lock()) {
+      if (lock_stats::enabled()) {
+        stats.acquired(shared, {}, false);
+      }
+      return;
+    }
+    auto asked = clock::now();
+    {
+      TRACE_SPAN(name);
+      lock();
+    }
+    if (lock_stats::enabled()) {
+      stats.acquired(shared, clock::now() - asked, true);
+    }
+  }
+
+  void release() {
+    if (lock_stats::enabled()) {
+      stats.released();
+    }
+  }
+
+ public:
+  explicit TracedMutex(const char* name) : name(name), stats(name, false) {
+  }
+
+  void lock() {
+    acquire(
+        false, [this] { return mutex.try_lock(); }, [this] { mutex.lock(); });
+  }
+
+  bool try_lock() {
+    if (!mutex.try_lock()) {
+      return false;
+    }
+    if (lock_stats::enabled()) {
+      stats.acquired(false, {}, false);
+    }
+    return true;
+  }
+
+  void unlock() {
+    release();
+    mutex.unlock();
+  }
+
+  void lock_shared() {
+    acquire(
+        true, [this] { return mutex.try_lock_shared(); },
+        [this] { mutex.lock_shared(); });
+  }
+
+  bool try_lock_shared() {
+    if (!mutex.try_lock_shared()) {
+      return false;
+    }
+    if (lock_stats::enabled()) {
+      stats.acquired(true, {}, false);
+    }
+    return true;
+  }
+
+  void unlock_shared() {
+    release();
+    mutex.unlock_shared();
+  }
+};
+
+/**
+ * Condition variable that shows up in the trace when a wait really waits
+ * (the predicate is false at first), and in lock_stats.
+ */
+class TracedCondition {
+ private:
+  using clock = lock_stats::LockStats::clock;
+
+  std::condition_variable_any condition;
+  [[maybe_unused]] const char* name;
+  lock_stats::LockStats stats;
+
+ public:
+  explicit TracedCondition(const char* name) : name(name), stats(name, true) {
+  }
+
+  template <typename Lock, typename Predicate>
+  void wait(Lock& lock, Predicate pred) {
+    if (pred()) {
+      return;
+    }
+    TRACE_SPAN(name);
+    auto start = clock::now();
+    uint64_t wakeups = 0;
+    do {
+      condition.wait(lock);
+      wakeups++;
+    } while (!pred());
+    if (lock_stats::enabled()) {
+      stats.waited(clock::now() - start, wakeups);
+    }
+  }
+
+  void notify_all() {
+    if (lock_stats::enabled()) {
+      stats.notified();
+    }
+    condition.notify_all();
+  }
+};
+
+#endif  // SIK_ZAD2_LOCKSTATS_H
@@ -11,6 +11,7 @@
 #include "ByteStream.h"
 #include "ClientState.h"
 #include "MessageUtils.h"
+#include "Roster.h"
 #include "ServerState.h"
 
 /**
@@ -65,6 +66,50 @@ class Join : public Sendable {
   }
 };
 
+/**
+ * First message on the extensions port - a mask of requested extensions.
+ */
+class Extensions : public Sendable {
+ private:
+  uint32_t flags;
+
+  uint8_t get_id() override {
+    return 4;
+  }
+
+ public:
+  explicit Extensions(uint32_t flags) : flags(flags){};
+
+  void serialize(ByteStream& os) override {
+    os << get_id() << flags;
+  }
+};
+
+/**
+ * Sent instead of Extensions by a client reconnecting after its connection
+ * dropped, with the token it got in ResumeToken and the last turn it has.
+ */
+class Resume : public Sendable {
+ private:
+  uint32_t flags;
+  uint64_t token;
+  // the first turn the client doesn't have - 0 if it has none yet, so
+  // every turn number (and "none") fits
+  uint32_t next_turn;
+
+  uint8_t get_id() override {
+    return 5;
+  }
+
+ public:
+  Resume(uint32_t flags, uint64_t token, uint32_t next_turn)
+      : flags(flags), token(token), next_turn(next_turn){};
+
+  void serialize(ByteStream& os) override {
+    os << get_id() << flags << token << next_turn;
+  }
+};
+
 /**
  * This is a factory that is supposed to be able to deserialize messages
  * of type InputMessage
@@ -90,12 +135,23 @@ class InputMessage : public Sendable {
 
   static std::shared_ptr<InputMessage> deserialize(ByteStream& istr) {
     uint8_t c;
+    istr.begin_message();
     istr >> c;
     if (!input_message_map().contains(c)) {
       throw InvalidMessageException();
     }
     return input_message_map()[c](istr);
   }
+
+  /**
+   * What this input of player id is going to change in the state, the way
+   * the server is going to apply it. Nothing if it changes nothing.
+   */
+  [[nodiscard]] virtual std::optional<Prediction> predict(
+      [[maybe_unused]] const ClientState& state,
+      [[maybe_unused]] PlayerId id) const {
+    return std::nullopt;
+  }
 };
 
 class PlaceBomb : public InputMessage {
@@ -115,6 +171,11 @@ class PlaceBomb : public InputMessage {
    */
   explicit PlaceBomb([[maybe_unused]] ByteStream& rest){};
 
+  [[nodiscard]] std::optional<Prediction> predict(const ClientState& state,
+                                                  PlayerId id) const override {
+    return state.predict_bomb(id);
+  }
+
   void serialize(ByteStream& os) override {
     os << get_id();
   }
@@ -163,6 +224,11 @@ class Move : public InputMessage {
     rest >> direction;
   };
 
+  [[nodiscard]] std::optional<Prediction> predict(const ClientState& state,
+                                                  PlayerId id) const override {
+    return state.predict_move(id, direction);
+  }
+
   void serialize(ByteStream& os) override {
     os << get_id() << direction;
   }
@@ -170,47 +236,53 @@ class Move : public InputMessage {
 
 class DrawMessage : public Sendable {};
 
+/**
+ * Encoded straight from the client state (it is sent every turn, so nothing
+ * is copied - the board and explosions are written from their bitmaps).
+ * A prediction is written over it: the local player at its predicted
+ * position and the predicted bomb after the real ones.
+ */
 class Game : public DrawMessage {
  private:
-  std::string server_name;
-  uint16_t size_x{};
-  uint16_t size_y{};
-  uint16_t game_length{};
-  uint16_t turn{};
-  std::map<PlayerId, Player> players;
-  std::map<PlayerId, Position> player_positions;
-  std::set<Position> blocks;
-  std::vector<Bomb> bombs;
-  std::set<Position> explosions;
-  std::map<PlayerId, Score> scores;
+  const ClientState& state;
+  std::optional<Prediction> prediction;
 
   uint8_t get_id() override {
     return 1;
   }
 
- public:
-  Game() = default;
-
-  explicit Game(const ClientState& c) {
-    server_name = c.server_name;
-    size_x = c.size_x;
-    size_y = c.size_y;
-    game_length = c.game_length;
-    turn = c.turn;
-    players = c.players;
-    player_positions = c.positions;
-    blocks = c.blocks;
-    for (auto [key, val] : c.bombs) {
-      bombs.push_back(val);
+  void write_positions(ByteStream& os) {
+    if (!prediction) {
+      os << state.positions;
+      return;
     }
-    explosions = c.explosions;
-    scores = c.scores;
+    os << (uint32_t)state.positions.size();
+    state.positions.for_each([&](PlayerId id, const Position& position) {
+      Position pos = id == prediction->id ? prediction->position : position;
+      os << id << pos;
+    });
+  }
+
+ public:
+  explicit Game(const ClientState& c,
+                std::optional<Prediction> prediction = std::nullopt)
+      : state(c), prediction(prediction) {
   }
 
   void serialize(ByteStream& os) override {
-    os << get_id() << server_name << size_x << size_y << game_length << turn
-       << players << player_positions << blocks << bombs << explosions
-       << scores;
+    bool predicted_bomb = prediction && prediction->bomb;
+    os << get_id() << state.server_name << state.size_x << state.size_y
+       << state.game_length << state.turn << state.players;
+    write_positions(os);
+    os << state.blocks << (uint32_t)(state.bombs.size() + predicted_bomb);
+    for (auto [id, bomb] : state.bombs) {
+      os << bomb;
+    }
+    if (predicted_bomb) {
+      Bomb bomb(prediction->position, state.bomb_timer);
+      os << bomb;
+    }
+    os << state.explosions << state.scores;
   }
 };
 
@@ -223,7 +295,7 @@ class Lobby : public DrawMessage {
   uint16_t game_length{};
   uint16_t explosion_radius{};
   uint16_t bomb_timer{};
-  std::map<PlayerId, Player> players;
+  std::shared_ptr<const Roster> players = Roster::empty();
 
   uint8_t get_id() override {
     return 0;
@@ -271,6 +343,7 @@ class ServerMessage : public Sendable {
 
   static std::shared_ptr<ServerMessage> deserialize(ByteStream& istr) {
     uint8_t c;
+    istr.begin_message();
     istr >> c;
     if (!server_message_map().contains(c)) {
       throw InvalidMessageException();
@@ -339,8 +412,9 @@ class Hello : public ServerMessage {
 
 class AcceptedPlayer : public ServerMessage {
  private:
-  PlayerId id{};
-  Player player;
+  // keeps the player's name and address
+  std::shared_ptr<const Roster> roster;
+  Roster::Entry player{};
 
   uint8_t get_id() override {
     return 1;
@@ -356,26 +430,42 @@ class AcceptedPlayer : public ServerMessage {
    * (deserializes the message on the go)
    */
   explicit AcceptedPlayer(ByteStream& stream) {
-    stream >> id >> player;
+    Player received;
+    stream >> player.id >> received;
+    roster = Roster::empty()->with(player.id, received.name, received.address);
+    player = *roster->find(player.id);
   };
 
-  AcceptedPlayer(PlayerId id, Player player) : id(id), player(std::move(player)){};
+  /**
+   * Player id of the roster (without a name and an address if it is not
+   * there), nothing is copied.
+   */
+  AcceptedPlayer(std::shared_ptr<const Roster> roster_in, PlayerId id)
+      : roster(std::move(roster_in)) {
+    if (const auto* entry = roster->find(id)) {
+      player = *entry;
+    }
+    player.id = id;
+  };
 
   bool update_client_state(ClientState& state_to_upd) override {
-    state_to_upd.players.insert({id, player});
-    state_to_upd.scores.insert({id, 0});
+    if (!state_to_upd.players->find(player.id)) {
+      state_to_upd.players = state_to_upd.players->with(
+          player.id, player.name, player.address);
+    }
+    state_to_upd.scores.insert(player.id, 0);
 
     return true;
   }
 
   void serialize(ByteStream& os) override {
-    os << get_id() << id << player;
+    os << get_id() << player.id << player.name << player.address;
   }
 };
 
 class GameStarted : public ServerMessage {
  private:
-  std::map<PlayerId, Player> players;
+  std::shared_ptr<const Roster> players;
 
   uint8_t get_id() override {
     return 2;
@@ -394,19 +484,16 @@ class GameStarted : public ServerMessage {
     stream >> players;
   };
 
-  explicit GameStarted(ServerState& state) {
-    players = state.get_players();
-  };
+  explicit GameStarted(ServerState& state) : players(state.get_roster()){};
 
-  explicit GameStarted(std::map<PlayerId, Player> players_in) {
-    players = std::move(players_in);
-  };
+  explicit GameStarted(std::shared_ptr<const Roster> players_in)
+      : players(std::move(players_in)){};
 
   bool update_client_state(ClientState& state_to_upd) override {
     state_to_upd.game_on = true;
     state_to_upd.players = players;
-    for (auto& k : players) {
-      state_to_upd.scores[k.first] = 0;
+    for (auto& player : *players) {
+      state_to_upd.scores[player.id] = 0;
     }
 
     return false;
@@ -440,6 +527,9 @@ class Event : public ServerMessage {
   static std::shared_ptr<Event> deserialize(ByteStream& istr) {
     uint8_t c;
     istr >> c;
+    if (!event_message_map().contains(c)) {
+      throw InvalidMessageException();
+    }
     return event_message_map()[c](istr);
   }
 };
@@ -483,7 +573,8 @@ class BombExploded : public Event {
  private:
   BombId id{};
   std::vector<PlayerId> robots_destroyed;
-  std::vector<Position> blocks_destroyed;
+  // sorted, so it can be delta-encoded
+  std::set<Position> blocks_destroyed;
 
   uint8_t get_id() override {
     return 1;
@@ -514,11 +605,11 @@ class BombExploded : public Event {
     state_to_upd.calculate_explosions(state_to_upd.bombs[id].position);
     state_to_upd.bombs.erase(id);
     for (auto& robotId : robots_destroyed) {
-      state_to_upd.would_die.insert(robotId);
-    }
-    for (auto const& block : blocks_destroyed) {
-      state_to_upd.blocks_to_destroy.insert(block);
+      state_to_upd.would_die.set(robotId);
     }
+    state_to_upd.blocks_to_destroy.insert(
+        state_to_upd.blocks_to_destroy.end(), blocks_destroyed.begin(),
+        blocks_destroyed.end());
 
     return true;
   }
@@ -623,8 +714,7 @@ class Turn : public ServerMessage {
    */
   explicit Turn(ByteStream& stream) {
     stream >> turn;
-    uint32_t len;
-    stream >> len;
+    uint32_t len = stream.read_length();
     events.resize(len);
     for (size_t i = 0; i < len; ++i) {
       events[i] = Event::create(stream);
@@ -637,10 +727,26 @@ class Turn : public ServerMessage {
     events.push_back(ev);
   }
 
+  [[nodiscard]] size_t get_events_count() const {
+    return events.size();
+  }
+
+  [[nodiscard]] uint16_t get_turn() const {
+    return turn;
+  }
+
+  /**
+   * A turn that is already applied (it came in a datagram before it came
+   * over tcp) changes nothing.
+   */
   bool update_client_state(ClientState& state_to_upd) override {
-    state_to_upd.explosions.clear();
+    if (state_to_upd.turn_applied && turn <= state_to_upd.turn) {
+      return false;
+    }
+    state_to_upd.turn_applied = true;
+    state_to_upd.explosions.reset();
     state_to_upd.blocks_to_destroy.clear();
-    state_to_upd.would_die.clear();
+    state_to_upd.would_die.reset();
 
     state_to_upd.turn = turn;
     for (auto& [id, bomb] : state_to_upd.bombs) {
@@ -649,8 +755,10 @@ class Turn : public ServerMessage {
     for (auto& event : events) {
       event->update_client_state(state_to_upd);
     }
-    for (auto id : state_to_upd.would_die) {
-      state_to_upd.scores[id]++;
+    for (size_t id = 0; id < state_to_upd.would_die.size(); ++id) {
+      if (state_to_upd.would_die[id]) {
+        state_to_upd.scores[(PlayerId)id]++;
+      }
     }
     for (auto destroyed : state_to_upd.blocks_to_destroy) {
       state_to_upd.blocks.erase(destroyed);
@@ -702,6 +810,191 @@ class GameEnded : public ServerMessage {
   }
 };
 
+/**
+ * Reply to Extensions - the subset of requested extensions that the server
+ * is going to use for this connection.
+ */
+class ExtensionsAccepted : public ServerMessage {
+ private:
+  uint32_t flags{};
+
+  uint8_t get_id() override {
+    return 5;
+  }
+
+ public:
+  static std::shared_ptr<ServerMessage> create(ByteStream& rest) {
+    return std::make_shared<ExtensionsAccepted>(rest);
+  }
+
+  /**
+   * Constructor that creates the object from a specified bytesream
+   * (deserializes the message on the go)
+   */
+  explicit ExtensionsAccepted(ByteStream& stream) {
+    stream >> flags;
+  };
+
+  explicit ExtensionsAccepted(uint32_t flags) : flags(flags){};
+
+  bool update_client_state(ClientState& state_to_upd) override {
+    state_to_upd.extensions = flags;
+
+    return false;
+  }
+
+  void serialize(ByteStream& os) override {
+    os << get_id() << flags;
+  }
+};
+
+/**
+ * Sent only to the player that joined (if it asked for extension::resume),
+ * and again when it resumes - then the missing turns follow.
+ */
+class ResumeToken : public ServerMessage {
+ private:
+  PlayerId id{};
+  uint64_t token{};
+
+  uint8_t get_id() override {
+    return 7;
+  }
+
+ public:
+  static std::shared_ptr<ServerMessage> create(ByteStream& rest) {
+    return std::make_shared<ResumeToken>(rest);
+  }
+
+  /**
+   * Constructor that creates the object from a specified bytesream
+   * (deserializes the message on the go)
+   */
+  explicit ResumeToken(ByteStream& stream) {
+    stream >> id >> token;
+  };
+
+  ResumeToken(PlayerId id, uint64_t token) : id(id), token(token){};
+
+  bool update_client_state(ClientState& state_to_upd) override {
+    state_to_upd.resume_token = token;
+
+    return false;
+  }
+
+  void serialize(ByteStream& os) override {
+    os << get_id() << id << token;
+  }
+};
+
+/**
+ * Sent right after ExtensionsAccepted if extension::datagrams was accepted.
+ * The client registers its udp socket by sending the token in a datagram
+ * to the server's extensions port, from then on every turn also comes
+ * in a datagram.
+ */
+class DatagramChannel : public ServerMessage {
+ private:
+  uint64_t token{};
+
+  uint8_t get_id() override {
+    return 8;
+  }
+
+ public:
+  static std::shared_ptr<ServerMessage> create(ByteStream& rest) {
+    return std::make_shared<DatagramChannel>(rest);
+  }
+
+  /**
+   * Constructor that creates the object from a specified bytesream
+   * (deserializes the message on the go)
+   */
+  explicit DatagramChannel(ByteStream& stream) {
+    stream >> token;
+  };
+
+  explicit DatagramChannel(uint64_t token) : token(token){};
+
+  bool update_client_state(ClientState& state_to_upd) override {
+    state_to_upd.datagram_token = token;
+
+    return false;
+  }
+
+  void serialize(ByteStream& os) override {
+    os << get_id() << token;
+  }
+};
+
+/**
+ * Sent instead of GameStarted and the whole turn history to late joiners
+ * that asked for extension::snapshot. It is the state of the game right
+ * after the last turn in history, later turns come as usual.
+ */
+class GameSnapshot : public ServerMessage {
+ private:
+  uint16_t turn{};
+  std::shared_ptr<const Roster> players;
+  PlayerMap<Position> positions;
+  Board blocks;
+  std::map<BombId, Bomb> bombs;
+  PlayerMap<Score> scores;
+
+  uint8_t get_id() override {
+    return 6;
+  }
+
+ public:
+  static std::shared_ptr<ServerMessage> create(ByteStream& rest) {
+    return std::make_shared<GameSnapshot>(rest);
+  }
+
+  /**
+   * Constructor that creates the object from a specified bytesream
+   * (deserializes the message on the go)
+   */
+  explicit GameSnapshot(ByteStream& stream) {
+    stream >> turn >> players >> positions >> blocks >> bombs >> scores;
+  };
+
+  explicit GameSnapshot(const ClientState& c)
+      : turn(c.turn),
+        players(c.players),
+        positions(c.positions),
+        blocks(c.blocks),
+        bombs(c.bombs),
+        scores(c.scores) {
+  }
+
+  bool update_client_state(ClientState& state_to_upd) override {
+    state_to_upd.reset();
+    state_to_upd.game_on = true;
+    state_to_upd.turn = turn;
+    state_to_upd.turn_applied = true;
+    state_to_upd.players = players;
+    state_to_upd.positions = positions;
+    state_to_upd.blocks = blocks;
+    state_to_upd.bombs = bombs;
+    state_to_upd.scores = scores;
+
+    return true;
+  }
+
+  void serialize(ByteStream& os) override {
+    os << get_id() << turn << players << positions << blocks << bombs
+       << scores;
+  }
+};
+
+/**
+ * Declared in ServerState.h, the snapshot is just a client-side view of
+ * the game kept up to date by the same code every client uses.
+ */
+void apply_turn_to_snapshot(Turn& turn, ClientState& snapshot) {
+  turn.update_client_state(snapshot);
+}
+
 /* May be changed so it is sendable instead of input message */
 class ClientMessage : public Message {
  public:
@@ -729,6 +1022,7 @@ class ClientMessage : public Message {
 
   static std::shared_ptr<ClientMessage> deserialize(ByteStream& istr) {
     uint8_t c;
+    istr.begin_message();
     istr >> c;
     if (!client_message_map().contains(c)) {
       throw InvalidMessageException();
@@ -790,6 +1084,8 @@ class ClientPlaceBomb : public ClientMessage {
    */
   explicit ClientPlaceBomb([[maybe_unused]] ByteStream& stream){};
 
+  ClientPlaceBomb() = default;
+
   void update_server_state(ServerState& state_to_upd, PlayerId id,
                          std::shared_ptr<Turn> cur_turn) override {
     uint32_t bomb_id = state_to_upd.place_bomb(state_to_upd.get_player_pos(id));
@@ -810,6 +1106,8 @@ class ClientPlaceBlock : public ClientMessage {
    */
   explicit ClientPlaceBlock([[maybe_unused]] ByteStream& stream){};
 
+  ClientPlaceBlock() = default;
+
   void update_server_state(ServerState& state_to_upd, PlayerId id,
                          std::shared_ptr<Turn> cur_turn) override {
     if (state_to_upd.place_block(state_to_upd.get_player_pos(id))) {
@@ -836,6 +1134,8 @@ class ClientMove : public ClientMessage {
     stream >> direction;
   };
 
+  explicit ClientMove(uint8_t direction) : direction(direction){};
+
   void update_server_state(ServerState& state_to_upd, PlayerId id,
                          std::shared_ptr<Turn> cur_turn) override {
     if (state_to_upd.move_player_in_direction(id, direction)) {
@@ -845,6 +1145,86 @@ class ClientMove : public ClientMessage {
   }
 };
 
+class ClientExtensions : public ClientMessage {
+ private:
+  uint32_t flags{};
+
+ public:
+  static std::shared_ptr<ClientMessage> create(ByteStream& rest) {
+    return std::make_shared<ClientExtensions>(rest);
+  }
+
+  /**
+   * Constructor that creates the object from a specified bytesream
+   * (deserializes the message on the go)
+   */
+  explicit ClientExtensions(ByteStream& stream) {
+    stream >> flags;
+  };
+
+  void update_server_state([[maybe_unused]] ServerState& state_to_upd,
+                           [[maybe_unused]] PlayerId id,
+                           [[maybe_unused]] std::shared_ptr<Turn> cur_turn)
+      override {
+  }
+
+  [[nodiscard]] uint32_t get_flags() const {
+    return flags;
+  }
+
+  static std::shared_ptr<ClientExtensions> deserialize_first(ByteStream& istr);
+};
+
+/**
+ * Extensions of a client coming back after its connection dropped.
+ */
+class ClientResume : public ClientExtensions {
+ private:
+  uint64_t token{};
+  uint32_t next_turn{};
+
+ public:
+  static std::shared_ptr<ClientMessage> create(ByteStream& rest) {
+    return std::make_shared<ClientResume>(rest);
+  }
+
+  /**
+   * Constructor that creates the object from a specified bytesream
+   * (deserializes the message on the go)
+   */
+  explicit ClientResume(ByteStream& stream) : ClientExtensions(stream) {
+    stream >> token >> next_turn;
+  };
+
+  [[nodiscard]] uint64_t get_token() const {
+    return token;
+  }
+
+  [[nodiscard]] uint32_t get_next_turn() const {
+    return next_turn;
+  }
+};
+
+/**
+ * Reads the first message on the extensions port - Extensions or Resume.
+ * They are not valid anywhere else, so they are not in the map of
+ * ClientMessage::deserialize (a client can't send them as an input).
+ * Anything else throws InvalidMessageException.
+ */
+inline std::shared_ptr<ClientExtensions> ClientExtensions::deserialize_first(
+    ByteStream& istr) {
+  uint8_t c;
+  istr.begin_message();
+  istr >> c;
+  if (c == 4) {
+    return std::make_shared<ClientExtensions>(istr);
+  }
+  if (c == 5) {
+    return std::make_shared<ClientResume>(istr);
+  }
+  throw InvalidMessageException();
+}
+
 /**
  * Needs to be called before serialization - it is needed to populate
  * factories' function pointer map.
@@ -862,6 +1242,10 @@ void register_all_client() {
   ServerMessage::register_to_map(2, GameStarted::create);
   ServerMessage::register_to_map(3, Turn::create);
   ServerMessage::register_to_map(4, GameEnded::create);
+  ServerMessage::register_to_map(5, ExtensionsAccepted::create);
+  ServerMessage::register_to_map(6, GameSnapshot::create);
+  ServerMessage::register_to_map(7, ResumeToken::create);
+  ServerMessage::register_to_map(8, DatagramChannel::create);
 }
 
 void register_all_server() {
@@ -0,0 +1,309 @@
+#ifndef SIK_ZAD2_MESSAGESCANNER_H
+#define SIK_ZAD2_MESSAGESCANNER_H
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "Message.h"
+
+/**
+ * Finds where server messages end in a byte stream that arrives in chunks
+ * of any size, without blocking and without building any objects.
+ * It is a state machine walking the layout of the messages (which has to be
+ * kept in sync with Message.h), every byte is looked at once and the state
+ * survives between chunks. When it reports that a whole message is there,
+ * the message can be deserialized from memory in one go.
+ */
+class ServerMessageScanner {
+ private:
+  struct Op;
+  using Seq = std::vector<Op>;
+
+  /**
+   * Fixed - a number (or a few) of known size
+   * Number - u16 or u32, of known size unless the stream is compact
+   * String - u8 length and that many bytes
+   * List - u32 count and that many times body
+   * Tagged - u8 tag and the body of matching variant
+   */
+  struct Op {
+    enum class Kind { Fixed, Number, String, List, Tagged } kind;
+    // Fixed, Number: its size,
+    // List: size of body if it is made of Fixed and Number only
+    size_t size{};
+    Seq body;
+    std::map<uint8_t, Seq> variants;
+    // List: body has a Number, so its size is not known in compact mode
+    bool has_numbers{};
+  };
+
+  struct Frame {
+    const Seq *seq;
+    size_t pc;
+    uint32_t repeat_left;
+  };
+
+  enum class NumberFor { StringLength, ListCount, Tag, Nothing };
+
+  std::vector<Frame> stack;
+  size_t skip_left{};
+  uint8_t number_bytes_left{};
+  bool in_varint{};
+  unsigned varint_shift{};
+  uint32_t number{};
+  NumberFor number_for{};
+  const Op *number_op{};
+  bool compact{};
+  DecodeLimits limits;
+  // of the current message, scanned before this call of scan()
+  size_t message_bytes{};
+
+  static Op fixed(size_t size) {
+    Op op{Op::Kind::Fixed, size, {}, {}, false};
+    return op;
+  }
+
+  static Op num(size_t size) {
+    Op op{Op::Kind::Number, size, {}, {}, false};
+    return op;
+  }
+
+  static Op string() {
+    Op op{Op::Kind::String, 0, {}, {}, false};
+    return op;
+  }
+
+  static Op list(Seq body) {
+    Op op{Op::Kind::List, 0, std::move(body), {}, false};
+    for (auto &element : op.body) {
+      if (element.kind != Op::Kind::Fixed &&
+          element.kind != Op::Kind::Number) {
+        op.size = 0;
+        break;
+      }
+      op.size += element.size;
+      op.has_numbers |= element.kind == Op::Kind::Number;
+    }
+    return op;
+  }
+
+  static Op tagged(std::map<uint8_t, Seq> variants) {
+    Op op{Op::Kind::Tagged, 0, {}, std::move(variants), false};
+    return op;
+  }
+
+  /**
+   * Layout of every ServerMessage, as serialized in Message.h.
+   */
+  static const Seq &message_layout() {
+    static const Seq layout = [] {
+      Seq position = {num(2), num(2)};
+      Seq player = {fixed(1), string(), string()};
+      Seq events_list = {
+          list({tagged({
+              {0, {num(4), num(2), num(2)}},                    // BombPlaced
+              {1, {num(4), list({fixed(1)}), list(position)}},  // BombExploded
+              {2, {fixed(1), num(2), num(2)}},                  // PlayerMoved
+              {3, position},                                    // BlockPlaced
+          })})};
+
+      Seq turn = {num(2)};
+      turn.insert(turn.end(), events_list.begin(), events_list.end());
+
+      return Seq{tagged({
+          {0, {string(), fixed(1), num(2), num(2), num(2), num(2),
+               num(2)}},                                      // Hello
+          {1, player},                                        // AcceptedPlayer
+          {2, {list(player)}},                                // GameStarted
+          {3, turn},                                          // Turn
+          {4, {list({fixed(1), num(4)})}},                    // GameEnded
+          {5, {num(4)}},                                      // ExtensionsAccepted
+          {6, {num(2), list(player), list({fixed(1), num(2), num(2)}),
+               list(position), list({num(4), num(2), num(2), num(2)}),
+               list({fixed(1), num(4)})}},                    // GameSnapshot
+          {7, {fixed(1), fixed(8)}},                          // ResumeToken
+          {8, {fixed(8)}},                                    // DatagramChannel
+      })};
+    }();
+    return layout;
+  }
+
+  void read_number(uint8_t bytes, NumberFor what, const Op *op) {
+    number_bytes_left = bytes;
+    in_varint = false;
+    number = 0;
+    number_for = what;
+    number_op = op;
+  }
+
+  void read_varint(NumberFor what, const Op *op) {
+    in_varint = true;
+    varint_shift = 0;
+    number = 0;
+    number_for = what;
+    number_op = op;
+  }
+
+  void number_read() {
+    switch (number_for) {
+      case NumberFor::StringLength:
+        skip_left = number;
+        break;
+      case NumberFor::ListCount:
+        if (number > limits.max_elements ||
+            number > limits.max_message_bytes) {
+          throw MessageTooLongException();
+        }
+        if (number == 0 || number_op->body.empty()) {
+          break;
+        }
+        if (number_op->size != 0 && !(compact && number_op->has_numbers)) {
+          skip_left = (size_t)number * number_op->size;
+        } else {
+          stack.push_back({&number_op->body, 0, number - 1});
+        }
+        break;
+      case NumberFor::Tag: {
+        auto variant = number_op->variants.find((uint8_t)number);
+        if (variant == number_op->variants.end()) {
+          throw InvalidMessageException();
+        }
+        stack.push_back({&variant->second, 0, 0});
+        break;
+      }
+      case NumberFor::Nothing:
+        break;
+    }
+  }
+
+ public:
+  /**
+   * From now on u16 and u32 numbers are expected as varints
+   * (the server has accepted extension::compact). Only between messages.
+   */
+  void set_compact(bool on) {
+    compact = on;
+  }
+
+  /**
+   * A list longer than limits.max_elements or a message longer than
+   * limits.max_message_bytes throws MessageTooLongException as soon as
+   * it is seen, so that it is not waited for (and buffered).
+   */
+  void set_limits(DecodeLimits new_limits) {
+    limits = new_limits;
+  }
+
+  /**
+   * Scans the next len bytes of the stream (continuing where the last call
+   * stopped). If a message ends among them, returns how many of them belong
+   * to it - the rest has to be passed again in the next call.
+   * Otherwise all of them were consumed and nullopt is returned.
+   * Throws InvalidMessageException on an unknown message or event type
+   * (or a varint too long for u32), MessageTooLongException when the
+   * limits are exceeded.
+   */
+  std::optional<size_t> scan(const uint8_t *data, size_t len) {
+    size_t pos = 0;
+    for (;;) {
+      if (message_bytes + pos + skip_left > limits.max_message_bytes) {
+        throw MessageTooLongException();
+      }
+      if (skip_left > 0) {
+        size_t take = std::min(skip_left, len - pos);
+        pos += take;
+        skip_left -= take;
+        if (skip_left > 0) {
+          message_bytes += len;
+          return std::nullopt;
+        }
+      }
+
+      if (number_bytes_left > 0) {
+        while (number_bytes_left > 0 && pos < len) {
+          number = number << 8 | data[pos++];
+          number_bytes_left--;
+        }
+        if (number_bytes_left > 0) {
+          message_bytes += len;
+          return std::nullopt;
+        }
+        number_read();
+        continue;
+      }
+
+      if (in_varint) {
+        bool done = false;
+        while (!done && pos < len) {
+          uint8_t byte = data[pos++];
+          if (varint_shift > 28) {
+            throw InvalidMessageException();
+          }
+          number |= (uint32_t)(byte & 0x7f) << varint_shift;
+          varint_shift += 7;
+          done = !(byte & 0x80);
+        }
+        if (!done) {
+          message_bytes += len;
+          return std::nullopt;
+        }
+        in_varint = false;
+        number_read();
+        continue;
+      }
+
+      if (stack.empty()) {
+        if (pos == len) {
+          return std::nullopt;
+        }
+        stack.push_back({&message_layout(), 0, 0});
+      }
+
+      Frame &frame = stack.back();
+      if (frame.pc == frame.seq->size()) {
+        if (frame.repeat_left > 0) {
+          frame.repeat_left--;
+          frame.pc = 0;
+          continue;
+        }
+        stack.pop_back();
+        if (stack.empty()) {
+          message_bytes = 0;
+          return pos;
+        }
+        continue;
+      }
+
+      const Op &op = (*frame.seq)[frame.pc++];
+      switch (op.kind) {
+        case Op::Kind::Fixed:
+          skip_left = op.size;
+          break;
+        case Op::Kind::Number:
+          if (compact) {
+            read_varint(NumberFor::Nothing, &op);
+          } else {
+            skip_left = op.size;
+          }
+          break;
+        case Op::Kind::String:
+          read_number(sizeof(uint8_t), NumberFor::StringLength, &op);
+          break;
+        case Op::Kind::List:
+          if (compact) {
+            read_varint(NumberFor::ListCount, &op);
+          } else {
+            read_number(sizeof(uint32_t), NumberFor::ListCount, &op);
+          }
+          break;
+        case Op::Kind::Tagged:
+          read_number(sizeof(uint8_t), NumberFor::Tag, &op);
+          break;
+      }
+    }
+  }
+};
+
+#endif  // SIK_ZAD2_MESSAGESCANNER_H
@@ -15,6 +15,34 @@ using PlayerId = uint8_t;
 using BombId = uint32_t;
 using Score = uint32_t;
 
+/**
+ * Protocol extensions a client can ask for (as a bit mask) in its first
+ * message on the server's extensions port. Stock clients use the regular
+ * port and never see any of them.
+ */
+namespace extension {
+// GameSnapshot instead of GameStarted + every Turn for late joiners
+const uint32_t snapshot = 1 << 0;
+// ResumeToken after joining, a dropped connection can come back with Resume
+const uint32_t resume = 1 << 1;
+// everything the server sends after ExtensionsAccepted is deflated
+const uint32_t compress = 1 << 2;
+// u16 and u32 after ExtensionsAccepted are LEB128 varints, sorted lists
+// of positions are delta-encoded (ByteStream's compact mode)
+const uint32_t compact = 1 << 3;
+// after ExtensionsAccepted every message (both ways) is preceded by
+// its u32 length (FramedStreamBuffer)
+const uint32_t framed = 1 << 4;
+// DatagramChannel after ExtensionsAccepted, turns also go over udp
+const uint32_t datagrams = 1 << 5;
+// unix domain socket connections only: everything the server sends after
+// ExtensionsAccepted goes through a shared memory ring (SharedRing.h)
+const uint32_t shared_ring = 1 << 6;
+
+const uint32_t all_supported =
+    snapshot | resume | compress | compact | framed | datagrams | shared_ring;
+}  // namespace extension
+
 struct PlayerInfo {
   std::string name;
   boost::asio::ip::tcp::endpoint endpoint;
@@ -64,6 +92,22 @@ class Position {
     os >> position.y;
     return os;
   }
+
+  /**
+   * Compact encoding in a sorted list: x as a difference from the previous
+   * position, y too if x is the same (otherwise as it is).
+   */
+  void write_after(ByteStream& os, const Position& prev) const {
+    auto dx = (uint16_t)(x - prev.x);
+    os << dx << (uint16_t)(dx == 0 ? y - prev.y : y);
+  }
+
+  void read_after(ByteStream& os, const Position& prev) {
+    uint16_t dx, dy_or_y;
+    os >> dx >> dy_or_y;
+    x = (uint16_t)(prev.x + dx);
+    y = dx == 0 ? (uint16_t)(prev.y + dy_or_y) : dy_or_y;
+  }
   bool operator==(const Position& pos2) const {
     return (x == pos2.x && y == pos2.y);
   }
@@ -0,0 +1,119 @@
+#ifndef SIK_ZAD2_PLAYERMAP_H
+#define SIK_ZAD2_PLAYERMAP_H
+
+#include <array>
+#include <bit>
+#include <cstdint>
+
+#include "ByteStream.h"
+#include "MessageUtils.h"
+
+/**
+ * Map from PlayerId to T (used for players' positions and scores).
+ * There are at most 256 players, so it is a flat array with a bitmask
+ * of which ids are there - no allocations and lookups are one index.
+ * Iterated (and serialized, exactly like std::map<PlayerId, T>) in id order.
+ */
+template <typename T>
+class PlayerMap {
+ private:
+  static const size_t ids = 256;
+  static const size_t word_bits = 64;
+
+  std::array<T, ids> values{};
+  std::array<uint64_t, ids / word_bits> present{};
+
+  static uint64_t bit_of(PlayerId id) {
+    return (uint64_t)1 << (id % word_bits);
+  }
+
+ public:
+  [[nodiscard]] bool contains(PlayerId id) const {
+    return present[id / word_bits] & bit_of(id);
+  }
+
+  /**
+   * Like std::map, a missing id is added with a default value.
+   */
+  T &operator[](PlayerId id) {
+    if (!contains(id)) {
+      present[id / word_bits] |= bit_of(id);
+      values[id] = T{};
+    }
+    return values[id];
+  }
+
+  const T &at(PlayerId id) const {
+    return values[id];
+  }
+
+  /**
+   * Returns false (and changes nothing) if the id was already there.
+   */
+  bool insert(PlayerId id, const T &value) {
+    if (contains(id)) {
+      return false;
+    }
+    present[id / word_bits] |= bit_of(id);
+    values[id] = value;
+    return true;
+  }
+
+  void erase(PlayerId id) {
+    present[id / word_bits] &= ~bit_of(id);
+  }
+
+  void clear() {
+    present.fill(0);
+  }
+
+  [[nodiscard]] size_t size() const {
+    size_t count = 0;
+    for (uint64_t word : present) {
+      count += (size_t)std::popcount(word);
+    }
+    return count;
+  }
+
+  [[nodiscard]] bool empty() const {
+    return size() == 0;
+  }
+
+  /**
+   * Calls f(id, value) for every id in the map, in increasing order.
+   */
+  template <typename F>
+  void for_each(F f) const {
+    for (size_t w = 0; w < present.size(); ++w) {
+      uint64_t word = present[w];
+      while (word) {
+        auto id = (PlayerId)(w * word_bits + (size_t)std::countr_zero(word));
+        word &= word - 1;
+        f(id, values[id]);
+      }
+    }
+  }
+
+  friend ByteStream &operator<<(ByteStream &os, const PlayerMap &map) {
+    os << (uint32_t)map.size();
+    map.for_each([&](PlayerId id, const T &value) {
+      T copy = value;
+      os << id << copy;
+    });
+    return os;
+  }
+
+  friend ByteStream &operator>>(ByteStream &os, PlayerMap &map) {
+    uint32_t len = os.read_length();
+    map.clear();
+    PlayerId id;
+    T value;
+    for (size_t i = 0; i < len; ++i) {
+      os >> id >> value;
+      map[id] = value;
+    }
+    return os;
+  }
+};
+
+#endif  // SIK_ZAD2_PLAYERMAP_H
@@ -25,6 +25,8 @@ class Randomizer {
 
     return Position(pos_x, pos_y);
   }
+
+  bool operator==(const Randomizer &) const = default;
 };
 
 #endif  // SIK_ZAD2_RANDOMIZER_H
@@ -0,0 +1,343 @@
+#ifndef SIK_ZAD2_REPLAY_H
+#define SIK_ZAD2_REPLAY_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Buffer.h"
+#include "ByteStream.h"
+#include "Message.h"
+
+/**
+ * Replay file layout (all numbers in network byte order, like the protocol):
+ *   [8 bytes magic "RBRPLAY1"][u64 turn_duration]
+ *   records - encoded server messages, exactly as sent to the clients:
+ *     Hello, GameStarted, Turn 0 ... Turn n-1, GameEnded
+ *   index - u64 file offset of every record, in order
+ *   [u32 records count][u64 index offset][8 bytes magic "RBRPEND1"]
+ * Record i spans from its offset to the offset of record i + 1 (the last one
+ * ends where the index starts), so any turn can be found in O(1).
+ */
+namespace replay_format {
+const char head_magic[] = "RBRPLAY1";
+const char tail_magic[] = "RBRPEND1";
+const size_t magic_len = 8;
+const size_t header_len = magic_len + sizeof(uint64_t);
+const size_t trailer_len = sizeof(uint32_t) + sizeof(uint64_t) + magic_len;
+// Hello and GameStarted
+const size_t records_before_turns = 2;
+}  // namespace replay_format
+
+class InvalidReplayException : public std::exception {
+  [[nodiscard]] const char *what() const noexcept override {
+    return "Not a complete replay file";
+  }
+};
+
+/**
+ * Persists games to replay files (one file per game) in a given directory.
+ * The turn thread only enqueues already broadcast (so no longer modified)
+ * messages, encoding and all file operations are done by a separate writer
+ * thread, so saving replays does not affect turn latency.
+ */
+class ReplayWriter {
+ private:
+  enum class RecordKind { GameStart, Message, GameEnd };
+
+  const std::string dir;
+  const uint64_t turn_duration;
+
+  std::mutex queue_mutex;
+  std::condition_variable_any queue_not_empty;
+  std::deque<std::pair<RecordKind, std::shared_ptr<ServerMessage>>> queue;
+
+  // accessed only by the writer thread
+  std::ofstream file;
+  std::string file_name;
+  std::vector<uint64_t> offsets;
+  uint64_t file_offset{};
+  uint32_t games_written{};
+  MemoryStreamBuffer *encoded;
+  ByteStream encoder;
+
+  std::jthread writer_thread;
+
+  void enqueue(RecordKind kind, std::shared_ptr<ServerMessage> msg) {
+    std::unique_lock lk(queue_mutex);
+    queue.emplace_back(kind, std::move(msg));
+    lk.unlock();
+    queue_not_empty.notify_one();
+  }
+
+  void write_encoded() {
+    file.write((const char *)encoded->get_output().data(),
+               (std::streamsize)encoded->get_output().size());
+    file_offset += encoded->get_output().size();
+    encoded->clear_output();
+  }
+
+  void open_file() {
+    file.close();
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    file_name =
+        dir + "/game-" +
+        std::to_string(
+            std::chrono::duration_cast<std::chrono::seconds>(now).count()) +
+        "-" + std::to_string(games_written++) + ".rpl";
+    file.open(file_name, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      std::cerr << "Cannot open replay file " << file_name << std::endl;
+      return;
+    }
+    offsets.clear();
+    file_offset = 0;
+    for (size_t i = 0; i < replay_format::magic_len; ++i) {
+      encoder << replay_format::head_magic[i];
+    }
+    encoder << turn_duration;
+    write_encoded();
+  }
+
+  void write_record(ServerMessage &msg) {
+    offsets.push_back(file_offset);
+    msg.serialize(encoder);
+    write_encoded();
+  }
+
+  void close_file() {
+    uint64_t index_offset = file_offset;
+    for (auto offset : offsets) {
+      encoder << offset;
+    }
+    encoder << (uint32_t)offsets.size() << index_offset;
+    for (size_t i = 0; i < replay_format::magic_len; ++i) {
+      encoder << replay_format::tail_magic[i];
+    }
+    write_encoded();
+    file.close();
+    if (!file) {
+      std::cerr << "Writing replay file " << file_name << " failed"
+                << std::endl;
+    }
+  }
+
+  void process(RecordKind kind, ServerMessage &msg) {
+    if (kind == RecordKind::GameStart) {
+      open_file();
+    }
+    if (!file.is_open()) {
+      return;
+    }
+    write_record(msg);
+    if (kind == RecordKind::GameEnd) {
+      close_file();
+    }
+  }
+
+  /**
+   * Writer thread - takes everything that was enqueued at once and
+   * writes it. On stop it still finishes what is in the queue.
+   */
+  void write_loop(const std::stop_token &stoken) {
+    std::deque<std::pair<RecordKind, std::shared_ptr<ServerMessage>>> todo;
+    for (;;) {
+      std::unique_lock lk(queue_mutex);
+      queue_not_empty.wait(lk, stoken, [&] { return !queue.empty(); });
+      todo.swap(queue);
+      lk.unlock();
+
+      if (todo.empty() && stoken.stop_requested()) {
+        return;
+      }
+      for (auto &[kind, msg] : todo) {
+        process(kind, *msg);
+      }
+      todo.clear();
+    }
+  }
+
+ public:
+  ReplayWriter(std::string dir, uint64_t turn_duration)
+      : dir(std::move(dir)),
+        turn_duration(turn_duration),
+        encoded(new MemoryStreamBuffer()),
+        encoder(std::unique_ptr<StreamBuffer>(encoded)),
+        writer_thread(&ReplayWriter::write_loop, this) {
+  }
+
+  /**
+   * Starts a new replay file, with configuration (Hello) and players' roster.
+   */
+  void begin_game(std::shared_ptr<ServerMessage> hello,
+                  std::shared_ptr<ServerMessage> game_started) {
+    enqueue(RecordKind::GameStart, std::move(hello));
+    enqueue(RecordKind::Message, std::move(game_started));
+  }
+
+  void add_turn(std::shared_ptr<ServerMessage> turn) {
+    enqueue(RecordKind::Message, std::move(turn));
+  }
+
+  void end_game(std::shared_ptr<ServerMessage> game_ended) {
+    enqueue(RecordKind::GameEnd, std::move(game_ended));
+  }
+};
+
+/**
+ * Read-only view of a replay file. The file is memory-mapped, records are
+ * never copied - they can be sent to a client as they are or decoded.
+ */
+class ReplayReader {
+ private:
+  const uint8_t *data{};
+  size_t size{};
+  uint64_t turn_duration{};
+  uint32_t records_count{};
+  uint64_t index_offset{};
+
+  [[nodiscard]] uint64_t read_u64(size_t offset) const {
+    uint64_t x;
+    std::memcpy(&x, data + offset, sizeof(x));
+    return be64toh(x);
+  }
+
+  [[nodiscard]] uint64_t get_record_offset(size_t i) const {
+    return read_u64(index_offset + i * sizeof(uint64_t));
+  }
+
+  /**
+   * The index has to fill the space between the records and the trailer
+   * exactly, and the records' offsets have to go up (a record may be
+   * empty) without leaving the records' part of the file, so that every
+   * get_record() stays inside the mapping.
+   */
+  [[nodiscard]] bool index_is_valid(size_t trailer) const {
+    if (index_offset < replay_format::header_len || index_offset > trailer ||
+        (trailer - index_offset) % sizeof(uint64_t) != 0 ||
+        (trailer - index_offset) / sizeof(uint64_t) != records_count) {
+      return false;
+    }
+    uint64_t prev = replay_format::header_len;
+    for (size_t i = 0; i < records_count; ++i) {
+      uint64_t offset = get_record_offset(i);
+      if (offset < prev || offset > index_offset) {
+        return false;
+      }
+      prev = offset;
+    }
+    return true;
+  }
+
+ public:
+  explicit ReplayReader(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+    struct stat st {};
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size <
+            replay_format::header_len + replay_format::trailer_len) {
+      close(fd);
+      throw InvalidReplayException();
+    }
+    size = (size_t)st.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      throw std::runtime_error("Cannot mmap " + path);
+    }
+    data = (const uint8_t *)mapped;
+
+    size_t trailer = size - replay_format::trailer_len;
+    uint32_t count;
+    std::memcpy(&count, data + trailer, sizeof(count));
+    records_count = ntohl(count);
+    index_offset = read_u64(trailer + sizeof(count));
+    turn_duration = read_u64(replay_format::magic_len);
+
+    if (std::memcmp(data, replay_format::head_magic,
+                    replay_format::magic_len) != 0 ||
+        std::memcmp(data + size - replay_format::magic_len,
+                    replay_format::tail_magic, replay_format::magic_len) != 0 ||
+        records_count < replay_format::records_before_turns + 1 ||
+        !index_is_valid(trailer)) {
+      munmap((void *)data, size);
+      throw InvalidReplayException();
+    }
+  }
+
+  ReplayReader(const ReplayReader &) = delete;
+  ReplayReader &operator=(const ReplayReader &) = delete;
+
+  ~ReplayReader() {
+    munmap((void *)data, size);
+  }
+
+  [[nodiscard]] uint64_t get_turn_duration() const {
+    return turn_duration;
+  }
+
+  [[nodiscard]] uint32_t get_turns_count() const {
+    return records_count - (uint32_t)replay_format::records_before_turns - 1;
+  }
+
+  /**
+   * Returns a pointer to the encoded record and its length.
+   */
+  [[nodiscard]] std::pair<const uint8_t *, size_t> get_record(size_t i) const {
+    uint64_t begin = get_record_offset(i);
+    uint64_t end =
+        i + 1 < records_count ? get_record_offset(i + 1) : index_offset;
+    return {data + begin, end - begin};
+  }
+
+  [[nodiscard]] std::pair<const uint8_t *, size_t> get_hello() const {
+    return get_record(0);
+  }
+
+  [[nodiscard]] std::pair<const uint8_t *, size_t> get_game_started() const {
+    return get_record(1);
+  }
+
+  [[nodiscard]] std::pair<const uint8_t *, size_t> get_turn(
+      uint32_t turn) const {
+    return get_record(replay_format::records_before_turns + turn);
+  }
+
+  [[nodiscard]] std::pair<const uint8_t *, size_t> get_game_ended() const {
+    return get_record(records_count - 1);
+  }
+
+  /**
+   * Decodes a single record (register_all_client() has to be called first).
+   */
+  static std::shared_ptr<ServerMessage> decode(
+      std::pair<const uint8_t *, size_t> record) {
+    auto *buffer = new MemoryStreamBuffer();
+    ByteStream stream((std::unique_ptr<StreamBuffer>(buffer)));
+    buffer->set_input(record.first, record.second);
+    // a list can't have more elements than the record has bytes
+    stream.set_limits({(uint32_t)std::min<size_t>(record.second, UINT32_MAX),
+                       record.second});
+    return ServerMessage::deserialize(stream);
+  }
+};
+
+#endif  // SIK_ZAD2_REPLAY_H
@@ -0,0 +1,223 @@
+#ifndef SIK_ZAD2_REPLAYPLAYER_H
+#define SIK_ZAD2_REPLAYPLAYER_H
+
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "Buffer.h"
+#include "ByteStream.h"
+#include "ClientState.h"
+#include "Message.h"
+#include "Replay.h"
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+namespace po = boost::program_options;
+
+/**
+ * Command line options of robots-replay. Exactly one of info, port and
+ * gui-address has to be given.
+ */
+struct ReplayCommandLineOpts {
+  std::string file;
+  bool info{};
+  uint16_t start_turn{};
+  double speed{};
+  uint16_t port{};
+  std::vector<std::string> display_addresses;
+
+  bool parse_command_line(int argc, char *argv[]) {
+    try {
+      po::options_description desc("Opcje programu");
+      desc.add_options()
+          ("help,h", "produce help message")
+          ("file,f", po::value<std::string>(&file)->required(), "<path>")
+          ("info,i", po::bool_switch(&info), "prints what is in the file")
+          ("turn,t", po::value<uint16_t>(&start_turn)->default_value(0),
+                   "<u16, turn to start playing from>")
+          ("speed,x", po::value<double>(&speed)->default_value(1.0),
+                   "<speed multiplier, 0 - as fast as possible>")
+          ("port,p", po::value<uint16_t>(&port),
+                   "<u16, serve the replay to a robots-client>")
+          ("gui-address,d",
+                   po::value<std::vector<std::string>>(&display_addresses),
+                   "<(nazwa hosta):(port) lub (IPv4):(port) lub (IPv6):(port)>, "
+                   "can be given many times");
+
+      po::variables_map vm;
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+
+      if (vm.count("help")) {
+        std::cout << desc << "\n";
+        return false;
+      }
+      po::notify(vm);
+
+      if (info + vm.count("port") + vm.count("gui-address") != 1) {
+        std::cerr << "Exactly one of --info, --port and --gui-address is "
+                     "needed\n";
+        return false;
+      }
+      if (speed < 0) {
+        std::cerr << "Speed cannot be negative\n";
+        return false;
+      }
+    } catch (std::exception &e) {
+      std::cerr << "Error: " << e.what() << "\n";
+      return false;
+    } catch (...) {
+      std::cerr << "Unknown error!"
+                << "\n";
+      return false;
+    }
+    return true;
+  }
+};
+
+/**
+ * Plays a replay file back. It can either pretend to be the server
+ * (a robots-client connects to it and gets exactly the bytes the original
+ * server sent) or drive a GUI directly.
+ * Turns before start_turn are sent (or applied) at once, the rest
+ * at turn_duration / speed intervals.
+ */
+class ReplayPlayer {
+ private:
+  using clock = std::chrono::steady_clock;
+
+  const ReplayCommandLineOpts &opts;
+  ReplayReader reader;
+  boost::asio::io_context &io_context;
+
+  [[nodiscard]] clock::duration turn_delay() const {
+    if (opts.speed == 0) {
+      return clock::duration::zero();
+    }
+    return std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double, std::milli>(
+            (double)reader.get_turn_duration() / opts.speed));
+  }
+
+  [[nodiscard]] uint32_t first_live_turn() const {
+    return std::min<uint32_t>(opts.start_turn, reader.get_turns_count());
+  }
+
+  static void write_record(tcp::socket &sock,
+                           std::pair<const uint8_t *, size_t> record) {
+    boost::asio::write(sock, boost::asio::buffer(record.first, record.second));
+  }
+
+  void serve_client(tcp::socket &sock) {
+    write_record(sock, reader.get_hello());
+    write_record(sock, reader.get_game_started());
+
+    // records are laid out one after another, so the whole history before
+    // the start turn is one contiguous write
+    uint32_t live = first_live_turn();
+    const uint8_t *history_begin = reader.get_turn(0).first;
+    const uint8_t *history_end = live < reader.get_turns_count()
+                                     ? reader.get_turn(live).first
+                                     : reader.get_game_ended().first;
+    write_record(sock, {history_begin, (size_t)(history_end - history_begin)});
+
+    auto next = clock::now();
+    for (uint32_t turn = live; turn < reader.get_turns_count(); ++turn) {
+      std::this_thread::sleep_until(next);
+      write_record(sock, reader.get_turn(turn));
+      next += turn_delay();
+    }
+    std::this_thread::sleep_until(next);
+    write_record(sock, reader.get_game_ended());
+  }
+
+  void serve() {
+    tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v6(), opts.port));
+    for (;;) {
+      tcp::socket sock(io_context);
+      acceptor.accept(sock);
+      sock.set_option(tcp::no_delay(true));
+      try {
+        serve_client(sock);
+      } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }
+
+  static void send_to_gui(ByteStream &udp_stream, const ClientState &state) {
+    udp_stream.reset();
+    if (!state.game_on) {
+      Lobby(state).serialize(udp_stream);
+    } else {
+      Game(state).serialize(udp_stream);
+    }
+    udp_stream.end_write();
+  }
+
+  void stream_to_gui() {
+    auto sock = std::make_shared<udp::socket>(io_context,
+                                              udp::endpoint(udp::v6(), 0));
+    ByteStream udp_stream(std::make_unique<UdpStreamBuffer>(
+        sock, opts.display_addresses, io_context));
+    ClientState state;
+
+    ReplayReader::decode(reader.get_hello())->update_client_state(state);
+    ReplayReader::decode(reader.get_game_started())
+        ->update_client_state(state);
+
+    uint32_t live = first_live_turn();
+    auto next = clock::now();
+    for (uint32_t turn = 0; turn < reader.get_turns_count(); ++turn) {
+      ReplayReader::decode(reader.get_turn(turn))->update_client_state(state);
+      if (turn >= live) {
+        std::this_thread::sleep_until(next);
+        send_to_gui(udp_stream, state);
+        next += turn_delay();
+      }
+    }
+    std::this_thread::sleep_until(next);
+    ReplayReader::decode(reader.get_game_ended())->update_client_state(state);
+    send_to_gui(udp_stream, state);
+  }
+
+  void print_info() {
+    ClientState state;
+    ReplayReader::decode(reader.get_hello())->update_client_state(state);
+    ReplayReader::decode(reader.get_game_started())
+        ->update_client_state(state);
+
+    std::cout << "server name: " << state.server_name << "\n"
+              << "board: " << state.size_x << "x" << state.size_y << "\n"
+              << "turn duration: " << reader.get_turn_duration() << " ms\n"
+              << "turns: " << reader.get_turns_count() << "\n"
+              << "players:\n";
+    for (auto &player : *state.players) {
+      std::cout << "  " << (int)player.id << " " << player << "\n";
+    }
+  }
+
+ public:
+  ReplayPlayer(boost::asio::io_context &io_context,
+               const ReplayCommandLineOpts &opts)
+      : opts(opts), reader(opts.file), io_context(io_context) {
+  }
+
+  void run() {
+    if (opts.info) {
+      print_info();
+    } else if (!opts.display_addresses.empty()) {
+      stream_to_gui();
+    } else {
+      serve();
+    }
+  }
+};
+
+#endif  // SIK_ZAD2_REPLAYPLAYER_H
@@ -0,0 +1,173 @@
+#ifndef SIK_ZAD2_ROSTER_H
+#define SIK_ZAD2_ROSTER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "ByteStream.h"
+#include "MessageUtils.h"
+
+/**
+ * Players of a game (ids with names and addresses), never changed once
+ * built - a player joining makes a new roster with(). It is shared as
+ * std::shared_ptr<const Roster> by the server state, the messages and the
+ * client state, so passing it around (or copying a state) costs a reference
+ * count instead of a map of strings.
+ * Names and addresses are kept back to back in one arena, the entries point
+ * into it. Entries are encoded (id, name, address - the same in compact
+ * mode) when the roster is built, so serializing it is a single write.
+ */
+class Roster {
+ public:
+  struct Entry {
+    PlayerId id;
+    std::string_view name;
+    std::string_view address;
+  };
+
+ private:
+  std::string arena;
+  // sorted by id
+  std::vector<Entry> entries;
+  std::vector<uint8_t> encoded;
+
+  // strings longer than that are cut, as ByteStream does
+  static std::string_view fit(std::string_view s) {
+    return s.substr(0, UINT8_MAX);
+  }
+
+  void encode(std::string_view s) {
+    encoded.push_back((uint8_t)s.size());
+    encoded.insert(encoded.end(), s.begin(), s.end());
+  }
+
+ public:
+  /**
+   * Copies the players (sorted by id, without repeated ids) into the arena.
+   */
+  explicit Roster(const std::vector<Entry> &players) {
+    size_t arena_size = 0;
+    for (auto &player : players) {
+      arena_size += fit(player.name).size() + fit(player.address).size();
+    }
+    // reserved up front, so the entries' views stay valid
+    arena.reserve(arena_size);
+    encoded.reserve(players.size() * 3 + arena_size);
+    entries.reserve(players.size());
+    for (auto &player : players) {
+      auto name = fit(player.name);
+      auto address = fit(player.address);
+      size_t offset = arena.size();
+      arena.append(name).append(address);
+      std::string_view stored(arena);
+      entries.push_back({player.id, stored.substr(offset, name.size()),
+                         stored.substr(offset + name.size(), address.size())});
+      encoded.push_back(player.id);
+      encode(name);
+      encode(address);
+    }
+  }
+
+  // the entries point into arena
+  Roster(const Roster &) = delete;
+  Roster &operator=(const Roster &) = delete;
+
+  static const std::shared_ptr<const Roster> &empty() {
+    static const auto roster =
+        std::make_shared<const Roster>(std::vector<Entry>());
+    return roster;
+  }
+
+  /**
+   * This roster with the player added (or replaced, if the id is taken).
+   */
+  [[nodiscard]] std::shared_ptr<const Roster> with(
+      PlayerId id, std::string_view name, std::string_view address) const {
+    std::vector<Entry> players;
+    players.reserve(entries.size() + 1);
+    auto it = std::lower_bound(
+        entries.begin(), entries.end(), id,
+        [](const Entry &entry, PlayerId key) { return entry.id < key; });
+    players.insert(players.end(), entries.begin(), it);
+    players.push_back({id, name, address});
+    if (it != entries.end() && it->id == id) {
+      ++it;
+    }
+    players.insert(players.end(), it, entries.end());
+    return std::make_shared<const Roster>(players);
+  }
+
+  [[nodiscard]] const Entry *find(PlayerId id) const {
+    auto it = std::lower_bound(
+        entries.begin(), entries.end(), id,
+        [](const Entry &entry, PlayerId key) { return entry.id < key; });
+    return it != entries.end() && it->id == id ? &*it : nullptr;
+  }
+
+  [[nodiscard]] size_t size() const {
+    return entries.size();
+  }
+
+  [[nodiscard]] std::vector<Entry>::const_iterator begin() const {
+    return entries.begin();
+  }
+
+  [[nodiscard]] std::vector<Entry>::const_iterator end() const {
+    return entries.end();
+  }
+
+  /**
+   * As a map of players: u32 count, then id, name and address of each.
+   */
+  void write(ByteStream &os) const {
+    os << (uint32_t)entries.size();
+    os.write_bytes(encoded.data(), encoded.size());
+  }
+
+  /**
+   * Reads what write() writes (a repeated id keeps its first player,
+   * as reading a map would).
+   */
+  static std::shared_ptr<const Roster> read(ByteStream &is) {
+    uint32_t len = is.read_length();
+    std::vector<std::pair<PlayerId, Player>> received(len);
+    for (auto &[id, player] : received) {
+      is >> id >> player;
+    }
+    std::stable_sort(received.begin(), received.end(),
+                     [](auto &a, auto &b) { return a.first < b.first; });
+    std::vector<Entry> players;
+    players.reserve(received.size());
+    for (auto &[id, player] : received) {
+      if (players.empty() || players.back().id != id) {
+        players.push_back({id, player.name, player.address});
+      }
+    }
+    return std::make_shared<const Roster>(players);
+  }
+
+  friend ByteStream &operator<<(ByteStream &os,
+                                const std::shared_ptr<const Roster> &roster) {
+    roster->write(os);
+    return os;
+  }
+
+  friend ByteStream &operator>>(ByteStream &is,
+                                std::shared_ptr<const Roster> &roster) {
+    roster = read(is);
+    return is;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const Entry &entry) {
+    os << "{" << entry.name << " : " << entry.address << "}";
+    return os;
+  }
+};
+
+#endif  // SIK_ZAD2_ROSTER_H
@@ -4,18 +4,35 @@
 #include <barrier>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
+#include <csignal>
+#include <deque>
+#include <future>
+#include <random>
 #include <shared_mutex>
 #include <thread>
 #include <utility>
 #include <vector>
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <sys/stat.h>
+#endif
+
+#include "Compression.h"
 #include "ConnectionUtils.h"
+#include "GameEngine.h"
+#include "IoUring.h"
 #include "Message.h"
 #include "MessageUtils.h"
+#include "Replay.h"
 #include "ServerState.h"
+#include "SharedRing.h"
 
 using boost::asio::ip::resolver_base;
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+using boost::asio::local::stream_protocol;
 
 /**
  * This class represents the server's brains. It creates one thread
@@ -23,14 +40,78 @@ using boost::asio::ip::tcp;
  * for receiving messages from players.
  */
 
+/**
+ * Turns of the current game, encoded once the way connections without
+ * extensions get them, for late joiners. Kept as immutable segments of at
+ * least segment_size bytes, which can be sent with MSG_ZEROCOPY (a segment
+ * stays alive as long as any send of it does), and the still growing tail.
+ * Guarded by Connector's connections_mutex.
+ */
+class HistoryLog {
+ public:
+  using Segment = std::shared_ptr<const std::vector<uint8_t>>;
+
+ private:
+  static const size_t segment_size = 64 * 1024;
+  std::vector<Segment> segments;
+  std::vector<uint8_t> tail;
+  size_t turns{};
+  MemoryStreamBuffer* buffer;
+  ByteStream stream;
+
+ public:
+  HistoryLog()
+      : buffer(new MemoryStreamBuffer()),
+        stream(std::unique_ptr<StreamBuffer>(buffer)) {
+  }
+
+  void add(Turn& turn) {
+    buffer->clear_output();
+    turn.serialize(stream);
+    auto& encoded = buffer->get_output();
+    tail.insert(tail.end(), encoded.begin(), encoded.end());
+    turns++;
+    if (tail.size() >= segment_size) {
+      segments.push_back(std::make_shared<const std::vector<uint8_t>>(
+          std::move(tail)));
+      tail.clear();
+    }
+  }
+
+  void clear() {
+    segments.clear();
+    tail.clear();
+    turns = 0;
+  }
+
+  [[nodiscard]] size_t get_turns() const {
+    return turns;
+  }
+
+  [[nodiscard]] const std::vector<Segment>& get_segments() const {
+    return segments;
+  }
+
+  [[nodiscard]] const std::vector<uint8_t>& get_tail() const {
+    return tail;
+  }
+};
+
 /**
  * Represents a connection with the player, main responsibilities are
  * receiving the message and passing it to a shared vector of players messages
  */
 class PlayerConnection {
  private:
-  std::shared_ptr<tcp::socket> socket;
+  static const uint64_t shared_ring_capacity = 1 << 20;
+  std::shared_ptr<StreamSocket> socket;
+  // shown to the others as the player's address
+  std::string address;
+  // came through the unix domain socket
+  bool local;
   ByteStream tcp_receive_stream;
+  // the innermost buffer of tcp_send_stream
+  StreamSocketBuffer* socket_send_buffer;
   ByteStream tcp_send_stream;
   std::shared_ptr<ServerState> server_state;
   std::optional<PlayerId> my_id;
@@ -38,29 +119,59 @@ class PlayerConnection {
 
   std::shared_ptr<std::barrier<>> game_start_barrier;
   std::mutex send_mutex;
+  // protocol extensions agreed on with this client
+  uint32_t extensions{};
+  // what the client presented in Resume (if it did)
+  std::optional<std::pair<uint64_t, uint32_t>> resume_request;
+  // where turn datagrams go (extension::datagrams), guarded by Connector
+  std::optional<udp::endpoint> datagram_endpoint;
+  // turn of the newest input that came in a datagram
+  std::optional<uint16_t> datagram_input_turn;
+  // history segments sent with MSG_ZEROCOPY that the kernel may still
+  // read, with the numbers of their sends (counted by the kernel from 0)
+  bool zerocopy = false;
+  uint32_t zerocopy_sends{};
+  std::deque<std::pair<uint32_t, HistoryLog::Segment>> zerocopy_pending;
 
  private:
   void start_playing() {
-    game_start_barrier->arrive_and_wait();
+    lock_stats::Site site("start_playing");
+    {
+      TRACE_SPAN("wait game start");
+      game_start_barrier->arrive_and_wait();
+    }
+    play();
+  }
+
+  /*
+   * Reads the next message. With extension::framed a message that can't be
+   * parsed (e.g. of a type this server doesn't know) is skipped - the next
+   * one starts at its own frame anyway. Otherwise it ends the connection.
+   */
+  std::shared_ptr<ClientMessage> receive_message() {
     for (;;) {
       tcp_receive_stream.reset();
-      std::shared_ptr<ClientMessage> received_message =
-          ClientMessage::deserialize(tcp_receive_stream);
-
-      std::shared_lock client_message_lock(
-          server_state->get_client_messages_rw());
-      server_state->get_wait_for_players_messages().wait(
-          client_message_lock, [&] {
-            return server_state->get_want_to_write_to_client_messages() == 0;
-          });
-
-      if (my_id) {
-        if (received_message->am_i_join()) {
-          continue;
+      try {
+        return ClientMessage::deserialize(tcp_receive_stream);
+      } catch (InvalidMessageException& e) {
+        if (!(extensions & extension::framed)) {
+          throw;
+        }
+      } catch (MessageTooShortException& e) {
+        if (!(extensions & extension::framed)) {
+          throw;
         }
-        server_state->get_messages_from_turn_no_sync()[*my_id] =
-            received_message;
-      } else {
+      }
+    }
+  }
+
+  /*
+   * Passes player's messages to the state until the game ends.
+   */
+  void play() {
+    for (;;) {
+      std::shared_ptr<ClientMessage> received_message = receive_message();
+      if (!store_input(received_message)) {
         last_msg.emplace(received_message);
         return;
       }
@@ -74,6 +185,8 @@ class PlayerConnection {
    * (so the server knows how many players are already ready)
    */
   void start_receive() {
+    TRACE_THREAD("receiver");
+    lock_stats::Site site("start_receive");
     try {
       for (;;) {
         std::shared_ptr<ClientMessage> rec_message;
@@ -85,19 +198,19 @@ class PlayerConnection {
          * on the message it got
          */
         if (!last_msg) {
-          tcp_receive_stream.reset();
-          rec_message = ClientMessage::deserialize(tcp_receive_stream);
+          rec_message = receive_message();
         } else {
           rec_message = *last_msg;
           last_msg.reset();
         }
 
-        std::stringstream endpoint_string;
-        endpoint_string << socket->remote_endpoint();
-
         if (!server_state->get_game_started() &&
-            rec_message->try_join(*server_state, my_id,
-                                  endpoint_string.str())) {
+            rec_message->try_join(*server_state, my_id, address)) {
+          if (extensions & extension::resume) {
+            ResumeToken token(*my_id,
+                              server_state->issue_resume_token(*my_id));
+            send_message(token);
+          }
           start_playing();
         }
       }
@@ -107,12 +220,262 @@ class PlayerConnection {
     }
   }
 
+  /*
+   * Used for connections on the extensions port (and the unix domain socket)
+   * - the first message has to be Extensions, it is answered with
+   * the supported subset of them. Datagrams are only for remote clients,
+   * the shared ring only for local ones.
+   * Returns false if the client sent anything else.
+   */
+  bool negotiate() {
+    tcp_receive_stream.reset();
+    std::shared_ptr<ClientExtensions> requested;
+    try {
+      requested = ClientExtensions::deserialize_first(tcp_receive_stream);
+    } catch (InvalidMessageException& e) {
+      return false;
+    }
+
+    extensions = requested->get_flags() & extension::all_supported;
+    extensions &= local ? ~extension::datagrams : ~extension::shared_ring;
+    ExtensionsAccepted accepted(extensions);
+    send_message(accepted);
+    if (extensions & extension::shared_ring) {
+      // the innermost one, it replaces the socket for sending
+      auto [ring, fds] = SharedRing::create(shared_ring_capacity);
+      bool passed = send_fds(socket->native_handle(), {fds.first, fds.second});
+      ::close(fds.first);
+      ::close(fds.second);
+      if (!passed) {
+        throw ConnectionAborted();
+      }
+      tcp_send_stream.wrap_buffer<SharedRingStreamBuffer>(std::move(ring));
+    }
+    if (extensions & extension::compress) {
+      tcp_send_stream.wrap_buffer<DeflateStreamBuffer>();
+    }
+    if (extensions & extension::framed) {
+      // outside of compression, so the headers are deflated too
+      tcp_send_stream.wrap_buffer<FramedStreamBuffer>();
+      tcp_receive_stream.wrap_buffer<FramedStreamBuffer>(
+          tcp_receive_stream.get_limits().max_message_bytes);
+    }
+    tcp_send_stream.set_compact((extensions & extension::compact) != 0);
+
+    auto resume = std::dynamic_pointer_cast<ClientResume>(requested);
+    if (resume && (extensions & extension::resume)) {
+      resume_request.emplace(resume->get_token(), resume->get_next_turn());
+    }
+    return true;
+  }
+
+  [[nodiscard]] const std::optional<std::pair<uint64_t, uint32_t>>&
+  get_resume_request() const {
+    return resume_request;
+  }
+
+  [[nodiscard]] uint32_t get_extensions() const {
+    return extensions;
+  }
+
+  [[nodiscard]] const std::optional<udp::endpoint>& get_datagram_endpoint()
+      const {
+    return datagram_endpoint;
+  }
+
+  void set_datagram_endpoint(const udp::endpoint& endpoint) {
+    datagram_endpoint = endpoint;
+  }
+
+  /*
+   * Makes the input this player's input in the current turn. Returns false
+   * (and does nothing) if the player is not in the game.
+   */
+  bool store_input(const std::shared_ptr<ClientMessage>& input) {
+    std::shared_lock client_message_lock(
+        server_state->get_client_messages_rw());
+    server_state->get_wait_for_players_messages().wait(
+        client_message_lock, [&] {
+          return server_state->get_want_to_write_to_client_messages() == 0;
+        });
+
+    if (!my_id) {
+      return false;
+    }
+    if (!input->am_i_join()) {
+      TRACE_INSTANT("input");
+      server_state->get_messages_from_turn_no_sync()[*my_id] = input;
+      if (extensions & extension::datagrams) {
+        server_state->drop_datagram_input(*my_id);
+      }
+    }
+    return true;
+  }
+
+  /*
+   * store_input for an input that came in a datagram. It is called on
+   * the io thread, so instead of waiting for the turn being played (and
+   * broadcast) it leaves the input for the turn to collect.
+   */
+  void post_datagram_input(const std::shared_ptr<ClientMessage>& input) {
+    auto id = my_id;
+    if (id && !input->am_i_join()) {
+      TRACE_INSTANT("input");
+      server_state->post_datagram_input(*id, input);
+    }
+  }
+
+  /*
+   * Datagrams can come out of order - an input made (after the client saw
+   * turn) before the newest one so far is not used. Guarded by Connector.
+   */
+  bool is_newest_datagram_input(uint16_t turn) {
+    if (datagram_input_turn && turn < *datagram_input_turn) {
+      return false;
+    }
+    datagram_input_turn = turn;
+    return true;
+  }
+
+  /*
+   * Continues as player id of the current game: sends ResumeToken and
+   * the turns from next_turn on (all of them, Turn 0 too, if the client
+   * has none). Returns false (and sends nothing) if the game doesn't have
+   * that turn (e.g. it has ended since).
+   */
+  bool send_resume_message(PlayerId id, uint64_t token, uint32_t next_turn) {
+    lock_stats::Site site("send_resume_message");
+    std::lock_guard lk(send_mutex);
+    std::shared_lock turns_lock(server_state->get_all_turns_mutex());
+    server_state->get_wait_for_turns().wait(turns_lock, [&] {
+      return server_state->get_want_to_write_to_turns() == 0;
+    });
+
+    auto& turns = server_state->get_all_turns_no_sync();
+    auto from = server_state->resume_from_no_sync(next_turn);
+    if (!from) {
+      return false;
+    }
+
+    my_id = id;
+    tcp_send_stream.reset();
+    ResumeToken(id, token).serialize(tcp_send_stream);
+    tcp_send_stream.end_message();
+    for (size_t i = *from; i < turns.size(); ++i) {
+      turns[i]->serialize(tcp_send_stream);
+      tcp_send_stream.end_message();
+    }
+    tcp_send_stream.end_write();
+    return true;
+  }
+
+  /*
+   * Receiving for a resumed connection - it is already in the game, so it
+   * doesn't wait for the start, and after the game it is like any other.
+   */
+  void resume_receive() {
+    try {
+      play();
+    } catch (std::exception& e) {
+      socket->close();
+      return;
+    }
+    start_receive();
+  }
+
+  void close() {
+    socket->close();
+  }
+
+  /*
+   * Drops the segments the kernel says (on the socket's error queue) it
+   * is done with.
+   */
+  void release_zerocopy_segments() {
+    while (!zerocopy_pending.empty()) {
+      std::array<uint8_t, 256> control{};
+      msghdr msg{};
+      msg.msg_control = control.data();
+      msg.msg_controllen = control.size();
+      if (recvmsg(socket->native_handle(), &msg,
+                  MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        return;
+      }
+      for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+            !(cmsg->cmsg_level == SOL_IPV6 &&
+              cmsg->cmsg_type == IPV6_RECVERR)) {
+          continue;
+        }
+        sock_extended_err err{};
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+        if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+          continue;
+        }
+        // sends ee_info..ee_data are done, tcp completes them in order
+        while (!zerocopy_pending.empty() &&
+               (int32_t)(zerocopy_pending.front().first - err.ee_data) <= 0) {
+          zerocopy_pending.pop_front();
+        }
+      }
+    }
+  }
+
+  /*
+   * The kernel sends straight from the segment's memory, so every
+   * connection shares the same pages instead of copying them. If it can't
+   * (ENOBUFS - too much pinned memory) the rest is copied.
+   */
+  void send_zerocopy(const HistoryLog::Segment& segment) {
+    size_t sent = 0;
+    while (sent < segment->size()) {
+      ssize_t n = ::send(socket->native_handle(), segment->data() + sent,
+                         segment->size() - sent, MSG_ZEROCOPY | MSG_NOSIGNAL);
+      if (n >= 0) {
+        sent += (size_t)n;
+        zerocopy_pending.emplace_back(zerocopy_sends++, segment);
+      } else if (errno == EAGAIN) {
+        pollfd writable{socket->native_handle(), POLLOUT, 0};
+        poll(&writable, 1, -1);
+      } else if (errno == ENOBUFS) {
+        boost::asio::write(*socket,
+                           boost::asio::buffer(segment->data() + sent,
+                                               segment->size() - sent));
+        return;
+      } else if (errno != EINTR) {
+        throw ConnectionAborted();
+      }
+    }
+  }
+
+  /*
+   * A plain connection gets the history as the log has it encoded - if
+   * the log has all the turns (it is cleared a moment before them).
+   */
+  bool send_history_from_log(const HistoryLog& history) {
+    if (!zerocopy ||
+        (extensions &
+         (extension::compress | extension::compact | extension::framed)) ||
+        history.get_turns() != server_state->get_all_turns_no_sync().size()) {
+      return false;
+    }
+    release_zerocopy_segments();
+    for (auto& segment : history.get_segments()) {
+      send_zerocopy(segment);
+    }
+    boost::asio::write(*socket, boost::asio::buffer(history.get_tail()));
+    return true;
+  }
+
   /*
    * A proper level of synchronization is needed here,
    * we block any players from joining and from connecting.
    * Accept a player and send them an initial message.
    */
-  void send_init_message() {
+  void send_init_message(const HistoryLog& history) {
+    TRACE_SPAN("send_init_message");
+    lock_stats::Site site("send_init_message");
     std::lock_guard lk(send_mutex);
     tcp_send_stream.reset();
     Hello(*server_state).serialize(tcp_send_stream);
@@ -128,25 +491,37 @@ class PlayerConnection {
         return server_state->get_want_to_write_to_players() == 0;
       });
 
-      GameStarted game_started_msg(server_state->get_players());
-      game_started_msg.serialize(tcp_send_stream);
-      tcp_send_stream.end_write();
-      tcp_send_stream.reset();
-
       std::shared_lock turns_lock(server_state->get_all_turns_mutex());
       server_state->get_wait_for_turns().wait(turns_lock, [&] {
         return server_state->get_want_to_write_to_turns() == 0;
       });
 
+      if (extensions & extension::snapshot) {
+        GameSnapshot(server_state->get_snapshot_no_sync())
+            .serialize(tcp_send_stream);
+        tcp_send_stream.end_write();
+        return;
+      }
+
+      GameStarted game_started_msg(server_state->get_roster());
+      game_started_msg.serialize(tcp_send_stream);
+      tcp_send_stream.end_write();
+      tcp_send_stream.reset();
+      if (send_history_from_log(history)) {
+        return;
+      }
+
       for (auto k : server_state->get_all_turns_no_sync()) {
         k->serialize(tcp_send_stream);
+        tcp_send_stream.end_message();
       }
 
       tcp_send_stream.end_write();
     } else {
-      std::map<PlayerId, Player> players = server_state->get_players();
-      for (auto [id, player] : players) {
-        AcceptedPlayer(id, player).serialize(tcp_send_stream);
+      auto roster = server_state->get_roster();
+      for (auto& player : *roster) {
+        AcceptedPlayer(roster, player.id).serialize(tcp_send_stream);
+        tcp_send_stream.end_message();
       }
       tcp_send_stream.end_write();
     }
@@ -154,28 +529,98 @@ class PlayerConnection {
 
   void send_message(ServerMessage& msg) {
     std::lock_guard lk(send_mutex);
+    release_zerocopy_segments();
     tcp_send_stream.reset();
     msg.serialize(tcp_send_stream);
     tcp_send_stream.end_write();
   }
 
+  /*
+   * For a batched broadcast: the message is encoded (as this connection
+   * encodes it), but its bytes are held (get_held_message()) for the caller
+   * to write while it holds the returned lock. With the shared ring they
+   * don't go to the socket at all - then the message is sent right away and
+   * the lock is empty.
+   */
+  std::unique_lock<std::mutex> hold_message(ServerMessage& msg) {
+    if (extensions & extension::shared_ring) {
+      send_message(msg);
+      return {};
+    }
+    std::unique_lock lk(send_mutex);
+    release_zerocopy_segments();
+    socket_send_buffer->hold();
+    try {
+      tcp_send_stream.reset();
+      msg.serialize(tcp_send_stream);
+      tcp_send_stream.end_write();
+    } catch (std::exception& e) {
+      socket_send_buffer->release_held();
+      throw;
+    }
+    return lk;
+  }
+
+  [[nodiscard]] const std::vector<uint8_t>& get_held_message() const {
+    return socket_send_buffer->get_held();
+  }
+
+  /*
+   * Called with the result of writing the held message: bytes written or
+   * -errno. What a short write left is written here.
+   */
+  void release_message(int written) {
+    auto& held = socket_send_buffer->get_held();
+    std::vector<uint8_t> rest;
+    if (written >= 0 && (size_t)written < held.size()) {
+      rest.assign(held.begin() + written, held.end());
+    }
+    socket_send_buffer->release_held();
+    if (written < 0) {
+      throw ConnectionAborted();
+    }
+    if (!rest.empty()) {
+      boost::asio::write(*socket, boost::asio::buffer(rest));
+    }
+  }
+
+  [[nodiscard]] int native_handle() {
+    return socket->native_handle();
+  }
+
   void end_playing() {
     my_id.reset();
+    datagram_input_turn.reset();
   }
 
-  explicit PlayerConnection(std::shared_ptr<ServerState> state,
-                            std::shared_ptr<std::barrier<>> game_start_barrier,
-                            std::shared_ptr<tcp::socket> sock)
+  PlayerConnection(std::shared_ptr<ServerState> state,
+                   std::shared_ptr<std::barrier<>> game_start_barrier,
+                   std::shared_ptr<StreamSocket> sock, std::string address,
+                   bool local)
       : socket(std::move(sock)),
-        tcp_receive_stream(std::make_unique<TcpStreamBuffer>(socket)),
-        tcp_send_stream(std::make_unique<TcpStreamBuffer>(socket)),
+        address(std::move(address)),
+        local(local),
+        tcp_receive_stream(std::make_unique<StreamSocketBuffer>(socket)),
+        socket_send_buffer(new StreamSocketBuffer(socket)),
+        tcp_send_stream(std::unique_ptr<StreamBuffer>(socket_send_buffer)),
         server_state(std::move(state)),
         game_start_barrier(std::move(game_start_barrier)) {
-    boost::asio::ip::tcp::no_delay option(true);
-    socket->set_option(option);
+    // clients send no lists, only short messages
+    tcp_receive_stream.set_limits(DecodeLimits::without_lists());
+    if (!this->local) {
+      int one = 1;
+      zerocopy = setsockopt(socket->native_handle(), SOL_SOCKET, SO_ZEROCOPY,
+                            &one, sizeof(one)) == 0;
+    }
   };
 };
 
+class UnixSocketPathException : public std::exception {
+  [[nodiscard]] const char* what() const noexcept override {
+    return "unix-socket path exists and is not a socket";
+  }
+};
+
 /*
  * This class main responsibility is accepting new players and
  * take care of sending initial message.
@@ -184,10 +629,34 @@ class Connector {
  private:
   boost::asio::io_context& io_context;
   tcp::acceptor acceptor;
+  std::optional<tcp::acceptor> extensions_acceptor;
+  std::optional<stream_protocol::acceptor> unix_acceptor;
   std::shared_ptr<ServerState> state;
   std::set<std::shared_ptr<PlayerConnection>> connections;
   std::shared_ptr<std::barrier<>> game_start_barrier;
   std::mutex connections_mutex;
+  HistoryLog history;
+
+  // --io-uring: a broadcast is written to all connections in one syscall
+  static const unsigned io_uring_entries = 256;
+  std::unique_ptr<IoUringSender> io_uring;
+
+  // extension::datagrams: a udp socket on the extensions port. Every turn
+  // goes (also) in a datagram with up to redundant_turns last turns, so
+  // a lost one is usually covered by the next. Clients send inputs there,
+  // with their DatagramChannel token.
+  static const size_t redundant_turns = 3;
+  static const size_t max_datagram_size = 65507;
+  std::optional<udp::socket> datagram_socket;
+  std::map<uint64_t, std::weak_ptr<PlayerConnection>> datagram_channels;
+  std::mt19937_64 token_generator{std::random_device{}()};
+  std::vector<uint8_t> datagram_in;
+  udp::endpoint datagram_from;
+  // one for reading (Connector's thread), one for encoding (server's thread)
+  MemoryStreamBuffer* datagram_in_buffer;
+  ByteStream datagram_in_stream;
+  MemoryStreamBuffer* datagram_out_buffer;
+  ByteStream datagram_out_stream;
 
   void start_accept() {
     std::shared_ptr<tcp::socket> new_socket =
@@ -198,32 +667,367 @@ class Connector {
                                  new_socket, boost::asio::placeholders::error));
   }
 
-  void connection_handler(
-      std::shared_ptr<tcp::socket> sock,
-      [[maybe_unused]] const boost::system::error_code& error) {
-    std::shared_ptr<PlayerConnection> new_connection =
-        std::make_shared<PlayerConnection>(state, game_start_barrier, sock);
+  void start_accept_extensions() {
+    std::shared_ptr<tcp::socket> new_socket =
+        std::make_shared<tcp::socket>(io_context);
+
+    extensions_acceptor->async_accept(
+        *new_socket,
+        boost::bind(&Connector::extensions_connection_handler, this,
+                    new_socket, boost::asio::placeholders::error));
+  }
+
+  void start_accept_unix() {
+    std::shared_ptr<stream_protocol::socket> new_socket =
+        std::make_shared<stream_protocol::socket>(io_context);
+
+    unix_acceptor->async_accept(
+        *new_socket, boost::bind(&Connector::unix_connection_handler, this,
+                                 new_socket, boost::asio::placeholders::error));
+  }
 
+  /*
+   * Connections are kept as StreamSocket, whatever they came through.
+   * Returns nullptr if the connection is already broken.
+   */
+  std::shared_ptr<PlayerConnection> tcp_connection(tcp::socket& sock) {
+    std::stringstream endpoint_string;
+    try {
+      sock.set_option(tcp::no_delay(true));
+      endpoint_string << sock.remote_endpoint();
+    } catch (std::exception& e) {
+      return nullptr;
+    }
+    return std::make_shared<PlayerConnection>(
+        state, game_start_barrier,
+        std::make_shared<StreamSocket>(std::move(sock)), endpoint_string.str(),
+        false);
+  }
+
+  /*
+   * A unix domain socket has no address worth showing, the player is
+   * shown as the pid of the process on the other end.
+   */
+  std::shared_ptr<PlayerConnection> unix_connection(
+      stream_protocol::socket& sock) {
+    ucred peer{};
+    socklen_t len = sizeof(peer);
+    if (getsockopt(sock.native_handle(), SOL_SOCKET, SO_PEERCRED, &peer,
+                   &len) != 0) {
+      return nullptr;
+    }
+    return std::make_shared<PlayerConnection>(
+        state, game_start_barrier,
+        std::make_shared<StreamSocket>(std::move(sock)),
+        "unix:" + std::to_string(peer.pid), true);
+  }
+
+  /*
+   * Sends the initial message and starts broadcasting to the connection.
+   * Returns false if the connection is already broken.
+   */
+  bool admit(const std::shared_ptr<PlayerConnection>& connection) {
     /* this is done to ensure that noone will broadcast now */
-    std::unique_lock lk(connections_mutex);
+    std::lock_guard lk(connections_mutex);
+
+    try {
+      connection->send_init_message(history);
+    } catch (std::exception& e) {
+      return false;
+    }
+
+    connections.insert(connection);
+    return true;
+  }
+
+  /*
+   * Re-attaches a connection that came with a Resume to its player, if the
+   * token is from this game. Otherwise (returns false) it is a new
+   * connection like any other.
+   * Tokens are cleared in finish() under the same lock, so a player can't
+   * be resumed into a game that has already ended.
+   */
+  bool try_resume(const std::shared_ptr<PlayerConnection>& connection) {
+    std::lock_guard lk(connections_mutex);
+
+    auto [token, next_turn] = *connection->get_resume_request();
+    auto id = state->find_resume_token(token);
+    if (!id || !connection->send_resume_message(*id, token, next_turn)) {
+      return false;
+    }
+
+    connections.insert(connection);
+    return true;
+  }
+
+  /*
+   * Gives the connection a token it can register its udp socket with.
+   */
+  void open_datagram_channel(
+      const std::shared_ptr<PlayerConnection>& connection) {
+    uint64_t token;
+    {
+      std::lock_guard lk(connections_mutex);
+      do {
+        token = token_generator();
+      } while (datagram_channels.contains(token));
+      datagram_channels[token] = connection;
+    }
+    DatagramChannel channel(token);
+    connection->send_message(channel);
+  }
+
+  void start_receive_datagram() {
+    datagram_socket->async_receive_from(
+        boost::asio::buffer(datagram_in), datagram_from,
+        [this](const boost::system::error_code& error, size_t len) {
+          if (!error) {
+            handle_datagram(len);
+          }
+          start_receive_datagram();
+        });
+  }
 
+  /*
+   * token: u64, turn: u16 (the last one the client saw) and optionally
+   * an input, serialized as over tcp. The sender becomes the connection's
+   * datagram endpoint. Anything broken or unknown is ignored.
+   */
+  void handle_datagram(size_t len) {
+    uint64_t token;
+    uint16_t turn;
+    std::shared_ptr<ClientMessage> input;
     try {
-      new_connection->send_init_message();
+      datagram_in_buffer->set_input(datagram_in.data(), len);
+      datagram_in_stream >> token >> turn;
+      if (datagram_in_buffer->get_read_offset() < len) {
+        input = ClientMessage::deserialize(datagram_in_stream);
+      }
     } catch (std::exception& e) {
-      start_accept();
       return;
     }
 
-    connections.insert(new_connection);
-    lk.unlock();
+    std::shared_ptr<PlayerConnection> connection;
+    {
+      std::lock_guard lk(connections_mutex);
+      auto channel = datagram_channels.find(token);
+      if (channel == datagram_channels.end()) {
+        return;
+      }
+      connection = channel->second.lock();
+      if (!connection) {
+        datagram_channels.erase(channel);
+        return;
+      }
+      connection->set_datagram_endpoint(datagram_from);
+      if (!input || !connection->is_newest_datagram_input(turn)) {
+        return;
+      }
+    }
+    if (state->get_game_started()) {
+      lock_stats::Site site("datagram input");
+      connection->post_datagram_input(input);
+    }
+  }
+
+  /*
+   * count: u8 and that many last turns (oldest first), as many as fit.
+   */
+  std::vector<uint8_t> encode_turn_datagram(bool compact) {
+    auto& turns = state->get_all_turns_no_sync();
+    std::vector<std::vector<uint8_t>> encoded;
+    size_t total = 1;
+    datagram_out_stream.set_compact(compact);
+    for (size_t i = turns.size(); i > 0 && encoded.size() < redundant_turns;
+         --i) {
+      datagram_out_buffer->clear_output();
+      turns[i - 1]->serialize(datagram_out_stream);
+      auto& turn = datagram_out_buffer->get_output();
+      if (total + turn.size() > max_datagram_size) {
+        break;
+      }
+      total += turn.size();
+      encoded.push_back(turn);
+    }
+
+    std::vector<uint8_t> datagram;
+    if (encoded.empty()) {
+      return datagram;
+    }
+    datagram.reserve(total);
+    datagram.push_back((uint8_t)encoded.size());
+    for (auto turn = encoded.rbegin(); turn != encoded.rend(); ++turn) {
+      datagram.insert(datagram.end(), turn->begin(), turn->end());
+    }
+    return datagram;
+  }
+
+  /*
+   * Only called by the server's thread, the only one adding turns,
+   * so the history can be read without its lock.
+   */
+  void send_turn_datagrams_no_sync() {
+    std::optional<std::vector<uint8_t>> datagrams[2];
+    for (auto& connection : connections) {
+      auto& endpoint = connection->get_datagram_endpoint();
+      if (!endpoint) {
+        continue;
+      }
+      bool compact = connection->get_extensions() & extension::compact;
+      auto& datagram = datagrams[compact];
+      if (!datagram) {
+        datagram = encode_turn_datagram(compact);
+      }
+      if (datagram->empty()) {
+        continue;  // the turn comes over tcp only
+      }
+      boost::system::error_code ignored;
+      datagram_socket->send_to(boost::asio::buffer(*datagram), *endpoint, 0,
+                               ignored);
+    }
+  }
+
+  void connection_handler(
+      std::shared_ptr<tcp::socket> sock,
+      [[maybe_unused]] const boost::system::error_code& error) {
+    TRACE_SPAN("accept");
+    std::shared_ptr<PlayerConnection> new_connection = tcp_connection(*sock);
 
-    std::jthread(&PlayerConnection::start_receive, new_connection).detach();
+    if (new_connection && admit(new_connection)) {
+      std::jthread(&PlayerConnection::start_receive, new_connection).detach();
+    }
     start_accept();
   }
 
+  /*
+   * Here the client speaks first, so it can't be done on the accepting
+   * thread - negotiation and the rest is done on the connection's own thread.
+   */
+  void start_negotiated(
+      const std::shared_ptr<PlayerConnection>& new_connection) {
+    std::jthread([this, new_connection] {
+      TRACE_THREAD("receiver");
+      try {
+        if (!new_connection->negotiate()) {
+          new_connection->close();
+          return;
+        }
+        if (new_connection->get_extensions() & extension::datagrams) {
+          open_datagram_channel(new_connection);
+        }
+        if (new_connection->get_resume_request() &&
+            try_resume(new_connection)) {
+          new_connection->resume_receive();
+          return;
+        }
+      } catch (std::exception& e) {
+        new_connection->close();
+        return;
+      }
+      if (admit(new_connection)) {
+        new_connection->start_receive();
+      }
+    }).detach();
+  }
+
+  void extensions_connection_handler(
+      std::shared_ptr<tcp::socket> sock,
+      [[maybe_unused]] const boost::system::error_code& error) {
+    TRACE_SPAN("accept");
+    std::shared_ptr<PlayerConnection> new_connection = tcp_connection(*sock);
+    if (new_connection) {
+      start_negotiated(new_connection);
+    }
+    start_accept_extensions();
+  }
+
+  void unix_connection_handler(
+      std::shared_ptr<stream_protocol::socket> sock,
+      [[maybe_unused]] const boost::system::error_code& error) {
+    TRACE_SPAN("accept");
+    std::shared_ptr<PlayerConnection> new_connection = unix_connection(*sock);
+    if (new_connection) {
+      start_negotiated(new_connection);
+    }
+    start_accept_unix();
+  }
+
+  /*
+   * Every connection encodes the message its own way, so first all of them
+   * do it, then the io_uring writes the results - one io_uring_enter per
+   * io_uring_entries connections.
+   */
+  void broadcast_batched_no_sync(
+      ServerMessage& msg,
+      std::set<std::shared_ptr<PlayerConnection>>& to_delete) {
+    std::vector<std::shared_ptr<PlayerConnection>> batch;
+    std::vector<std::unique_lock<std::mutex>> locks;
+    auto write_batch = [&] {
+      for (auto& connection : batch) {
+        auto& held = connection->get_held_message();
+        io_uring->add_send(connection->native_handle(), held.data(),
+                           held.size());
+      }
+      std::vector<int> results = io_uring->submit();
+      for (size_t i = 0; i < batch.size(); ++i) {
+        try {
+          batch[i]->release_message(results[i]);
+        } catch (std::exception& e) {
+          to_delete.insert(batch[i]);
+        }
+      }
+      batch.clear();
+      locks.clear();
+    };
+
+    for (auto& connection : connections) {
+      try {
+        auto lock = connection->hold_message(msg);
+        if (!lock) {
+          continue;  // already sent
+        }
+        batch.push_back(connection);
+        locks.push_back(std::move(lock));
+      } catch (std::exception& e) {
+        to_delete.insert(connection);
+        continue;
+      }
+      if (batch.size() == io_uring->capacity()) {
+        write_batch();
+      }
+    }
+    write_batch();
+  }
+
+  void broadcast_no_sync(ServerMessage& msg) {
+    std::set<std::shared_ptr<PlayerConnection>> to_delete;
+    if (io_uring) {
+      broadcast_batched_no_sync(msg, to_delete);
+    } else {
+      for (auto& connection : connections) {
+        try {
+          connection->send_message(msg);
+        } catch (std::exception& e) {
+          to_delete.insert(connection);
+        }
+      }
+    }
+    for (auto& connection : to_delete) {
+      connections.erase(connection);
+    }
+  }
+
  public:
   void init() {
+    TRACE_THREAD("connector");
     start_accept();
+    if (extensions_acceptor) {
+      start_accept_extensions();
+      start_receive_datagram();
+    }
+    if (unix_acceptor) {
+      start_accept_unix();
+    }
     io_context.run();
   }
 
@@ -233,18 +1037,28 @@ class Connector {
    * In addition - if something fails during send, server removes this player.
    */
   void broadcast_message(ServerMessage& msg) {
+    TRACE_SPAN("broadcast");
     std::lock_guard lk(connections_mutex);
-    std::set<std::shared_ptr<PlayerConnection>> to_delete;
-    for (auto& connection : connections) {
-      try {
-        connection->send_message(msg);
-      } catch (std::exception& e) {
-        to_delete.insert(connection);
-      }
+    broadcast_no_sync(msg);
+  }
+
+  /**
+   * Same as above, but the turn is also added to the history while no one
+   * can connect, so every connection gets each turn exactly once - either
+   * with the initial message or from this broadcast.
+   */
+  void broadcast_turn(const std::shared_ptr<Turn>& turn) {
+    TRACE_SPAN("broadcast_turn");
+    std::lock_guard lk(connections_mutex);
+    state->add_turn_sync(turn);
+    if (turn->get_turn() == 0) {
+      history.clear();
     }
-    for (auto& connection : to_delete) {
-      connections.erase(connection);
+    history.add(*turn);
+    if (datagram_socket) {
+      send_turn_datagrams_no_sync();
     }
+    broadcast_no_sync(*turn);
   }
 
   /**
@@ -253,6 +1067,8 @@ class Connector {
    */
   void finish() {
     std::lock_guard lk(connections_mutex);
+    state->clear_resume_tokens();
+    history.clear();
     std::set<std::shared_ptr<PlayerConnection>> to_delete;
     for (auto& connection : connections) {
       try {
@@ -274,9 +1090,39 @@ class Connector {
       : io_context(io_context),
         acceptor(io_context, tcp::endpoint(tcp::v6(), opts.port)),
         state(std::move(state)),
-        game_start_barrier(std::move(game_start_barrier)){
-
-        };
+        game_start_barrier(std::move(game_start_barrier)),
+        datagram_in(max_datagram_size),
+        datagram_in_buffer(new MemoryStreamBuffer()),
+        datagram_in_stream(std::unique_ptr<StreamBuffer>(datagram_in_buffer)),
+        datagram_out_buffer(new MemoryStreamBuffer()),
+        datagram_out_stream(
+            std::unique_ptr<StreamBuffer>(datagram_out_buffer)) {
+    if (opts.extensions_port) {
+      extensions_acceptor.emplace(
+          io_context, tcp::endpoint(tcp::v6(), *opts.extensions_port));
+      datagram_socket.emplace(
+          io_context, udp::endpoint(udp::v6(), *opts.extensions_port));
+    }
+    if (opts.io_uring) {
+      io_uring = IoUringSender::create(io_uring_entries);
+      if (!io_uring) {
+        std::cerr << "io_uring is not available, broadcasting with send()"
+                  << std::endl;
+      }
+    }
+    if (!opts.unix_socket.empty()) {
+      // a socket left by the last run is removed, anything else is kept
+      struct stat st {};
+      if (::lstat(opts.unix_socket.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+          throw UnixSocketPathException();
+        }
+        ::unlink(opts.unix_socket.c_str());
+      }
+      unix_acceptor.emplace(io_context,
+                            stream_protocol::endpoint(opts.unix_socket));
+    }
+  };
 };
 
 /*
@@ -285,11 +1131,79 @@ class Connector {
  */
 class Server {
  private:
+  // --trace-dir: every game's trace is written there when it ends; first,
+  // so that tracing and lock statistics are set up before any member starts
+  // a thread
+  std::string trace_dir;
+  size_t traced_games{};
   std::shared_ptr<ServerState> server_state;
+  GameEngine engine;
   std::shared_ptr<std::barrier<>> game_start_barrier;
   std::shared_ptr<Connector> connector;
   std::jthread connector_thread;
   boost::asio::steady_timer turn_timer;
+  std::unique_ptr<ReplayWriter> replay;
+  std::future<PreparedGame> next_game;
+
+  static void dump_trace(const std::string& dir, const std::string& name) {
+    std::string path = dir + "/trace-" + name + ".json";
+    if (!trace::registry.dump(path)) {
+      std::cerr << "Cannot write " << path << std::endl;
+    }
+  }
+
+  /*
+   * Tracing (--trace-dir) and lock statistics (--lock-stats) are on from
+   * the start, SIGUSR1 writes the trace recorded since the last dump and
+   * the statistics so far (to stderr). The signal is blocked in every
+   * thread (the mask is inherited, so this has to be done before any is
+   * started) and taken by sigwait() in a thread of its own - delivered to
+   * any other it would interrupt its blocking calls. Returns the trace
+   * directory, or nothing if tracing is off or not compiled in.
+   */
+  static std::string start_diagnostics(const ServerCommandLineOpts& opts) {
+    std::string dir = opts.trace_dir;
+    if (!dir.empty() && !trace::compiled_in) {
+      std::cerr << "Tracing is not compiled in (build with -DROBOTS_TRACE)"
+                << std::endl;
+      dir.clear();
+    }
+    bool lock_stats = opts.lock_stats;
+    if (dir.empty() && !lock_stats) {
+      return dir;
+    }
+    trace::registry.enabled = !dir.empty();
+    lock_stats::enabled_flag = lock_stats;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread([dir, lock_stats, signals] {
+      int signal;
+      while (sigwait(&signals, &signal) == 0) {
+        if (!dir.empty()) {
+          dump_trace(dir, "now");
+        }
+        if (lock_stats) {
+          lock_stats::registry.dump(std::cerr);
+        }
+      }
+    }).detach();
+    return dir;
+  }
+
+  /*
+   * Starts computing the next game's turn 0 in the background. The generator
+   * is not used between games, so it's done as soon as the current game's
+   * last turn is done (and before the first game).
+   */
+  void prepare_next_game() {
+    next_game = std::async(std::launch::async,
+                           [this, rand = server_state->get_rand()] {
+                             return engine.prepare_game(rand);
+                           });
+  }
 
   /*
    * Here the waiting is done, after each player joins, this thread
@@ -297,14 +1211,12 @@ class Server {
    * After enough players join, init_game() is called.
    */
   void start_lobby() {
+    lock_stats::Site site("start_lobby");
     for (uint8_t i = 0; i < server_state->get_players_count(); ++i) {
       game_start_barrier->arrive_and_wait();
 
-      auto player = server_state->get_player_sync(
-          i);  // safe read - at this moment this slot
-               // ought to be valid and written to
-
-      AcceptedPlayer acc_msg = AcceptedPlayer(i, player);
+      // safe read - at this moment this slot ought to be valid and written to
+      AcceptedPlayer acc_msg(server_state->get_roster(), i);
       connector->broadcast_message(
           acc_msg);  // this is responsibility of connector to synchronize
                      // correctly
@@ -314,49 +1226,27 @@ class Server {
     server_state->start_game();  // atomic
     connector->broadcast_message(
         game_started_message);  // connector's responsibility
+    if (replay) {
+      replay->begin_game(std::make_shared<Hello>(*server_state),
+                         std::make_shared<GameStarted>(game_started_message));
+    }
 
     init_game();
   }
 
   /* players don't interfere with server state directly during the game, all
-   * interpretations of their messages is done here, in this class
-   * Here, initial players' and blocks' positions are set and
-   * turn 0 is being prepared.
+   * interpretations of their messages is done by the engine.
+   * Here turn 0 (initial players' and blocks' positions) is being prepared.
    */
   void init_game() {
-    std::shared_ptr<Turn> init_turn = std::make_shared<Turn>(
-        0);  // preparations for the game, initial positions etc
-
-    /* Loop for randomly choosing players' initial positions
-     * After we choose the posiion, we create a message out of it,
-     * make changes in server_state and add this message to
-     * turn0 messages
-     */
-    for (auto [playerId, player] : server_state->get_players()) {
-      Position init_pos = server_state->get_rand().get_next_position(
-          server_state->get_size_x(), server_state->get_size_y());
-
-      std::shared_ptr<PlayerMoved> msg =
-          std::make_shared<PlayerMoved>(playerId, init_pos);
-      server_state->move_player(playerId, init_pos);
-      init_turn->addEvent(msg);
-    }
-
-    /* A loop doing the same as above, but with blocks' initial poisitions. */
-    for (uint16_t i = 0; i < server_state->get_initial_blocks(); ++i) {
-      Position init_pos = server_state->get_rand().get_next_position(
-          server_state->get_size_x(), server_state->get_size_y());
-
-      if (server_state->place_block(init_pos)) {
-        std::shared_ptr<BlockPlaced> msg =
-            std::make_shared<BlockPlaced>(init_pos);
-
-        init_turn->addEvent(msg);
-      }
-    }
+    std::shared_ptr<Turn> init_turn = next_game.valid()
+                                          ? engine.init_game(next_game.get())
+                                          : engine.init_game();
 
-    connector->broadcast_message(*init_turn);
-    server_state->add_turn_sync(init_turn);
+    connector->broadcast_turn(init_turn);
+    if (replay) {
+      replay->add_turn(init_turn);
+    }
 
     start_game();
   }
@@ -368,10 +1258,23 @@ class Server {
       turn_timer.wait();
       do_one_turn(i);
     }
+    prepare_next_game();
     end_game();
+    if (!trace_dir.empty()) {
+      dump_trace(trace_dir, std::to_string(traced_games++));
+    }
   }
 
+  /*
+   * Scores are taken before the reset. Client messages are unblocked before
+   * GameEnded is broadcast, so players can already join the next lobby
+   * in the meantime.
+   */
   void end_game() {
+    TRACE_SPAN("end_game");
+    lock_stats::Site site("end_game");
+    auto new_msg = std::make_shared<GameEnded>(server_state->get_scores());
+
     server_state
         ->get_want_to_write_to_client_messages()++;  // blocking all that got
                                                      // any messages
@@ -381,67 +1284,54 @@ class Server {
 
     server_state->reset();
     server_state->get_want_to_write_to_client_messages()--;
+    lk.unlock();
     server_state->wake_waiting_for_shared_client_messages();
 
-    auto new_msg = GameEnded(server_state->get_scores());
-    connector->broadcast_message(new_msg);
+    connector->broadcast_message(*new_msg);
+    if (replay) {
+      replay->end_game(new_msg);
+    }
   }
 
   /* Here is the course of one round. First we block incoming messages from
-   * overwriting what was collected during the last round.
-   * Then it is calculated which bombs have exploded, which players have died
-   * and which blocks were destroyed and after all of that, messags from
-   * players that survived are being processed.
+   * overwriting what was collected during the last round, then the engine
+   * processes them and the resulting turn is broadcast.
    */
   void do_one_turn(uint16_t turn_num) {
+    TRACE_SPAN("turn");
+    lock_stats::Site site("do_one_turn");
     server_state->get_want_to_write_to_client_messages()++;
     std::unique_lock lk(
         server_state
             ->get_client_messages_mutex());  // blocking saving recent messages,
                                              // since the turn has ended
-    std::shared_ptr<Turn> cur_turn = std::make_shared<Turn>(turn_num);
-
-    for (auto [id, bomb] : server_state->get_bombs()) {
-      auto opt_val = server_state->check_bomb(id);
-      if (opt_val) {
-        auto [a, b] = *opt_val;
-        std::shared_ptr<BombExploded> bomb_explosion =
-            std::make_shared<BombExploded>(id, b, a);
-        cur_turn->addEvent(bomb_explosion);
-      }
-    }
-
-    auto dead_players = server_state->clean_up_bombs();
-
-    for (auto [id, msg] : server_state->get_messages_from_turn_no_sync()) {
-      if (!dead_players.contains(id) && msg) {
-        msg->update_server_state(*server_state, id,
-                                 cur_turn);  // and id, //and turn
-      } else if (dead_players.contains(id)) {
-        Position new_pos = server_state->get_rand().get_next_position(
-            server_state->get_size_x(), server_state->get_size_y());
+    server_state->collect_datagram_inputs_no_sync();
+    std::shared_ptr<Turn> cur_turn = engine.play_turn(turn_num);
 
-        std::shared_ptr<PlayerMoved> new_msg =
-            std::make_shared<PlayerMoved>(id, new_pos);
-        server_state->move_player(id, new_pos);
-        cur_turn->addEvent(new_msg);
-      }
+    connector->broadcast_turn(cur_turn);
+    if (replay) {
+      replay->add_turn(cur_turn);
     }
-    server_state->reset_messages_from_players_no_sync();
-    connector->broadcast_message(*cur_turn);
-    server_state->add_turn_sync(cur_turn);
     server_state->get_want_to_write_to_client_messages()--;
     server_state->wake_waiting_for_shared_client_messages();
   }
 
  public:
   Server(boost::asio::io_context& io_context, ServerCommandLineOpts opts)
-      : server_state(std::make_shared<ServerState>(opts)),
+      : trace_dir(start_diagnostics(opts)),
+        server_state(std::make_shared<ServerState>(opts)),
+        engine(*server_state),
         game_start_barrier(std::make_shared<std::barrier<>>(2)),
         connector(std::make_shared<Connector>(io_context, opts, server_state,
                                               game_start_barrier)),
-        turn_timer(io_context) {
+        turn_timer(io_context),
+        replay(opts.replay_dir.empty()
+                   ? nullptr
+                   : std::make_unique<ReplayWriter>(opts.replay_dir,
+                                                    opts.turn_duration)) {
+    TRACE_THREAD("turns");
     connector_thread = std::jthread(&Connector::init, connector);
+    prepare_next_game();
 
     for (;;) {
       start_lobby();
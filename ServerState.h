@@ -4,18 +4,28 @@
 #include <boost/program_options.hpp>
 #include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <random>
 #include <shared_mutex>
 #include <string>
 #include <utility>
 
+#include "Board.h"
+#include "ClientState.h"
+#include "LockStats.h"
 #include "MessageUtils.h"
 #include "Randomizer.h"
+#include "Roster.h"
 
 class Turn;
 class ClientMessage;
 class Event;
 
+// defined in Message.h, after Turn
+void apply_turn_to_snapshot(Turn &turn, ClientState &snapshot);
+
 namespace po = boost::program_options;
 
 struct ServerCommandLineOpts {
@@ -30,6 +40,12 @@ struct ServerCommandLineOpts {
   uint32_t seed{};
   uint16_t size_x{};
   uint16_t size_y{};
+  std::string replay_dir;
+  std::optional<uint16_t> extensions_port;
+  std::string unix_socket;
+  std::string trace_dir;
+  bool io_uring{};
+  bool lock_stats{};
 
   bool validate() {
     if (players_count == 0) {
@@ -68,7 +84,25 @@ struct ServerCommandLineOpts {
                                        "<String>")
           ("seed,s", po::value<uint32_t>(&seed), "<u32, parametr opcjonalny>")
           ("size-x,x", po::value<uint16_t>(&size_x)->required(), "<u16>")
-          ("size-y,y", po::value<uint16_t>(&size_y)->required(), "<u16>");
+          ("size-y,y", po::value<uint16_t>(&size_y)->required(), "<u16>")
+          ("replay-dir,r", po::value<std::string>(&replay_dir),
+                   "<path, parametr opcjonalny - zapisuje tu powtórki gier>")
+          ("extensions-port,P", po::value<uint16_t>(),
+                   "<u16, parametr opcjonalny - port dla klientów z "
+                   "rozszerzeniami protokołu>")
+          ("unix-socket,u", po::value<std::string>(&unix_socket),
+                   "<path, parametr opcjonalny - gniazdo uniksowe dla klientów "
+                   "z rozszerzeniami protokołu na tym samym hoście>")
+          ("io-uring", po::bool_switch(&io_uring),
+                   "broadcasts are written to all clients with one io_uring "
+                   "submission (plain send() if io_uring is not available)")
+          ("trace-dir", po::value<std::string>(&trace_dir),
+                   "<path, parametr opcjonalny - zapisuje tu przebieg każdej "
+                   "gry w formacie Chrome trace (SIGUSR1 - to, co jest do "
+                   "tej pory); wymaga kompilacji z -DROBOTS_TRACE>")
+          ("lock-stats", po::bool_switch(&lock_stats),
+                   "collects wait and hold times of the state's locks per "
+                   "call site, SIGUSR1 prints them to stderr");
 
       po::variables_map vm;
       po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -77,6 +111,9 @@ struct ServerCommandLineOpts {
         std::cout << desc << "\n";
         return false;
       }
+      if (vm.count("extensions-port")) {
+        extensions_port = vm["extensions-port"].as<uint16_t>();
+      }
       if (!vm.count("seed")) {
         seed = (uint32_t)std::chrono::system_clock::now()
                    .time_since_epoch()
@@ -138,28 +175,35 @@ struct ServerConfiguration {
 // When the server tries to collect the data, then we got a problem and
 // have to get exclusive access (cause server wants to read the whole thing
 // and no one can be able to do any changes)
+// Waiting for any of them shows up in the trace (Trace.h) and in the lock
+// statistics (LockStats.h).
 struct Synchronizer {
-  using rw_mutex = std::shared_mutex;
+  using rw_mutex = TracedMutex<std::shared_mutex>;
+  using mutex = TracedMutex<std::mutex>;
+  using condition = TracedCondition;
 
   rw_mutex client_messages_rw;
   rw_mutex players_rw;
   rw_mutex turns_rw;
+  // only held to move a single input, never while a turn is played
+  mutex datagram_inputs_mutex;
 
-  std::condition_variable_any wait_for_shared_turns;
-  std::condition_variable_any wait_for_shared_client_messages;
-  std::condition_variable_any wait_for_shared_players;
+  condition wait_for_shared_turns;
+  condition wait_for_shared_client_messages;
+  condition wait_for_shared_players;
 
   std::atomic<uint8_t> want_to_write_to_players;
   std::atomic<uint8_t> want_to_write_to_client_messages;
   std::atomic<uint8_t> want_to_write_to_turns;
 
   Synchronizer()
-      : client_messages_rw(),
-        players_rw(),
-        turns_rw(),
-        wait_for_shared_turns(),
-        wait_for_shared_client_messages(),
-        wait_for_shared_players(),
+      : client_messages_rw("lock client_messages"),
+        players_rw("lock players"),
+        turns_rw("lock turns"),
+        datagram_inputs_mutex("lock datagram_inputs"),
+        wait_for_shared_turns("wait turns"),
+        wait_for_shared_client_messages("wait client_messages"),
+        wait_for_shared_players("wait players"),
         want_to_write_to_players(),
         want_to_write_to_client_messages(),
         want_to_write_to_turns() {
@@ -169,44 +213,75 @@ struct Synchronizer {
 class ServerState {
  private:
   const ServerConfiguration server_config;
-  std::map<PlayerId, Player> players;
+  // replaced (atomic_store) under players_rw, read with atomic_load anywhere
+  std::shared_ptr<const Roster> roster = Roster::empty();
   Randomizer rand;
   uint32_t next_bomb_id{};
   std::vector<std::shared_ptr<Turn>> all_turns;
   std::map<PlayerId, Position> positions;
   std::map<PlayerId, Score> scores;
   std::map<BombId, Bomb> bombs;
-  std::set<Position> blocks;
+  Board blocks;
   std::map<PlayerId, std::shared_ptr<ClientMessage>> messages_from_this_turn;
+  // inputs that came in datagrams (on the io thread, which can't wait for
+  // a turn to be played and broadcast), the turn collects them
+  std::map<PlayerId, std::shared_ptr<ClientMessage>> datagram_inputs;
   std::set<PlayerId> would_die;
   std::set<Position> blocks_destroyed;
   std::atomic_uint8_t next_player_id;
   std::atomic<bool> game_started;
+  // client-side view of the game after the last turn in all_turns,
+  // guarded like all_turns - only kept up to date if a client can ask for
+  // it (extension::snapshot is only negotiated on -P and -u connections)
+  ClientState snapshot;
+  bool keep_snapshot;
+
+  // tokens of players that can resume their connection in this game,
+  // random (not from rand, which has to stay deterministic)
+  std::map<uint64_t, PlayerId> resume_tokens;
+  std::mt19937_64 token_generator{std::random_device{}()};
+  std::mutex resume_tokens_mutex;
 
   Synchronizer synchro;
 
  public:
+  /**
+   * Prepares the state for the next game. The biggest containers are only
+   * swapped out under the locks and freed after releasing them.
+   */
   void reset() {
+    std::vector<std::shared_ptr<Turn>> old_turns;
+    Board old_blocks;
+    ClientState old_snapshot;
+
     synchro.want_to_write_to_turns++;
     synchro.want_to_write_to_players++;
     std::unique_lock turns_lock(synchro.turns_rw);
     std::unique_lock players_lock(synchro.players_rw);
 
-    players.clear();
+    std::atomic_store(&roster, Roster::empty());
     next_player_id = 0;
     game_started = false;
     next_bomb_id = 0;
-    all_turns.clear();
+    old_turns.swap(all_turns);
     positions.clear();
     scores.clear();
     bombs.clear();
-    blocks.clear();
+    old_blocks.swap(blocks);
     messages_from_this_turn.clear();
+    {
+      std::lock_guard lk(synchro.datagram_inputs_mutex);
+      datagram_inputs.clear();
+    }
     would_die.clear();
     blocks_destroyed.clear();
+    old_snapshot.blocks.swap(snapshot.blocks);
+    snapshot.reset();
 
     synchro.want_to_write_to_turns--;
     synchro.want_to_write_to_players--;
+    turns_lock.unlock();
+    players_lock.unlock();
     wake_waiting_for_shared_turn();
     wake_waiting_for_shared_players();
   }
@@ -217,7 +292,8 @@ class ServerState {
       id = possible_id;
       synchro.want_to_write_to_players++;
       std::unique_lock lk(synchro.players_rw);
-      players[possible_id] = std::move(p);
+      std::atomic_store(&roster, std::atomic_load(&roster)->with(
+                                     possible_id, p.name, p.address));
       synchro.want_to_write_to_players--;
       lk.unlock();
       wake_waiting_for_shared_players();
@@ -389,6 +465,17 @@ class ServerState {
     return std::optional<std::pair<std::set<Position>, std::set<PlayerId>>>();
   }
 
+  [[nodiscard]] const Board &get_blocks() const {
+    return blocks;
+  }
+
+  /**
+   * Replaces all blocks at once (with ones prepared in advance).
+   */
+  void set_blocks(Board &&new_blocks) {
+    blocks = std::move(new_blocks);
+  }
+
   bool place_block(Position pos) {
     if (blocks.contains(pos)) {
       return false;
@@ -410,7 +497,21 @@ class ServerState {
     return server_config.server_name;
   }
 
+  /**
+   * Called by the server thread once every player has joined.
+   */
   void start_game() {
+    synchro.want_to_write_to_turns++;
+    std::unique_lock lk(synchro.turns_rw);
+    snapshot.game_on = true;
+    snapshot.players = get_roster();
+    for (auto &player : *snapshot.players) {
+      snapshot.scores[player.id] = 0;
+    }
+    synchro.want_to_write_to_turns--;
+    lk.unlock();
+    wake_waiting_for_shared_turn();
+
     game_started = true;
   }
 
@@ -440,11 +541,11 @@ class ServerState {
 
   // Functions that have to do something with sync
 
-  std::shared_mutex &get_client_messages_rw() {
+  Synchronizer::rw_mutex &get_client_messages_rw() {
     return synchro.client_messages_rw;
   }
 
-  std::condition_variable_any &get_wait_for_players_messages() {
+  Synchronizer::condition &get_wait_for_players_messages() {
     return synchro.wait_for_shared_client_messages;
   }
 
@@ -452,9 +553,30 @@ class ServerState {
       &get_messages_from_turn_no_sync() {
     return messages_from_this_turn;
   }
-  Player get_player_sync(PlayerId id) {
-    std::lock_guard lk(synchro.players_rw);
-    return players[id];
+  void post_datagram_input(PlayerId id,
+                           std::shared_ptr<ClientMessage> input) {
+    std::lock_guard lk(synchro.datagram_inputs_mutex);
+    datagram_inputs[id] = std::move(input);
+  }
+
+  /**
+   * An input that came over tcp after one in a datagram replaces it.
+   */
+  void drop_datagram_input(PlayerId id) {
+    std::lock_guard lk(synchro.datagram_inputs_mutex);
+    datagram_inputs.erase(id);
+  }
+
+  /**
+   * Moves the inputs from datagrams to this turn's messages - called by
+   * the turn, with client messages locked exclusively.
+   */
+  void collect_datagram_inputs_no_sync() {
+    std::lock_guard lk(synchro.datagram_inputs_mutex);
+    for (auto &[id, input] : datagram_inputs) {
+      messages_from_this_turn[id] = std::move(input);
+    }
+    datagram_inputs.clear();
   }
 
   void reset_messages_from_players_no_sync() {
@@ -465,6 +587,9 @@ class ServerState {
     synchro.want_to_write_to_turns++;
     std::unique_lock lk(synchro.turns_rw);
     all_turns.push_back(t);
+    if (keep_snapshot) {
+      apply_turn_to_snapshot(*t, snapshot);
+    }
     synchro.want_to_write_to_turns--;
     lk.unlock();
     wake_waiting_for_shared_turn();
@@ -474,27 +599,71 @@ class ServerState {
     return all_turns;
   }
 
-  std::map<PlayerId, Player> &get_players() {
-    return players;
+  /**
+   * Index in all_turns of the first turn to send to a client resuming
+   * with next_turn (the first one it doesn't have, 0 - it has none).
+   * Nothing if this game doesn't have that turn (e.g. it has ended since).
+   */
+  [[nodiscard]] std::optional<size_t> resume_from_no_sync(
+      uint32_t next_turn) const {
+    if (!game_started || next_turn > all_turns.size()) {
+      return std::nullopt;
+    }
+    return next_turn;
+  }
+
+  const ClientState &get_snapshot_no_sync() const {
+    return snapshot;
+  }
+
+  uint64_t issue_resume_token(PlayerId id) {
+    std::lock_guard lk(resume_tokens_mutex);
+    uint64_t token;
+    do {
+      token = token_generator();
+    } while (resume_tokens.contains(token));
+    resume_tokens[token] = id;
+    return token;
+  }
+
+  std::optional<PlayerId> find_resume_token(uint64_t token) {
+    std::lock_guard lk(resume_tokens_mutex);
+    auto it = resume_tokens.find(token);
+    if (it == resume_tokens.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  void clear_resume_tokens() {
+    std::lock_guard lk(resume_tokens_mutex);
+    resume_tokens.clear();
+  }
+
+  /**
+   * The players who have joined so far (all of them once the game starts).
+   */
+  [[nodiscard]] std::shared_ptr<const Roster> get_roster() const {
+    return std::atomic_load(&roster);
   }
 
   const std::atomic<bool> &get_game_started() const {
     return game_started;
   }
 
-  [[nodiscard]] std::shared_mutex &get_players_mutex() {
+  [[nodiscard]] Synchronizer::rw_mutex &get_players_mutex() {
     return synchro.players_rw;
   }
 
-  [[nodiscard]] std::shared_mutex &get_all_turns_mutex() {
+  [[nodiscard]] Synchronizer::rw_mutex &get_all_turns_mutex() {
     return synchro.turns_rw;
   }
 
-  [[nodiscard]] std::shared_mutex &get_client_messages_mutex() {
+  [[nodiscard]] Synchronizer::rw_mutex &get_client_messages_mutex() {
     return synchro.client_messages_rw;
   }
 
-  std::condition_variable_any &get_wait_for_turns() {
+  Synchronizer::condition &get_wait_for_turns() {
     return synchro.wait_for_shared_turns;
   }
 
@@ -502,7 +671,7 @@ class ServerState {
     return synchro.want_to_write_to_turns;
   }
 
-  std::condition_variable_any &get_wait_for_players() {
+  Synchronizer::condition &get_wait_for_players() {
     return synchro.wait_for_shared_players;
   }
 
@@ -527,7 +696,18 @@ class ServerState {
   }
 
   explicit ServerState(ServerCommandLineOpts opts)
-      : server_config(opts), rand(server_config.seed), game_started(false) {
+      : server_config(opts),
+        rand(server_config.seed),
+        game_started(false),
+        keep_snapshot(opts.extensions_port || !opts.unix_socket.empty()) {
+    snapshot.server_name = server_config.server_name;
+    snapshot.players_count = server_config.players_count;
+    snapshot.size_x = server_config.size_x;
+    snapshot.size_y = server_config.size_y;
+    snapshot.game_length = server_config.game_length;
+    snapshot.explosion_radius = server_config.explosion_radius;
+    snapshot.bomb_timer = server_config.bomb_timer;
+    snapshot.reset();
   }
 };
 
@@ -0,0 +1,313 @@
+#ifndef SIK_ZAD2_SHAREDRING_H
+#define SIK_ZAD2_SHAREDRING_H
+
+#ifdef __linux__
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Buffer.h"
+
+class SharedRingException : public BufferException {
+  [[nodiscard]] const char* what() const noexcept override {
+    return "Shared memory ring could not be set up";
+  }
+};
+
+/**
+ * Single producer, single consumer byte ring in memory shared by two
+ * processes (a memfd), with an eventfd to wake the consumer up.
+ * The consumer says it is going to sleep before it waits for the eventfd,
+ * and the producer writes to the eventfd only then - while the consumer
+ * keeps up, passing bytes costs no syscalls on either side.
+ */
+class SharedRing {
+ private:
+  struct Header {
+    // bytes ever written / read, only the producer / consumer changes it
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> consumer_sleeping;
+    uint64_t capacity;
+  };
+  static const size_t data_offset = (sizeof(Header) + 63) / 64 * 64;
+
+  int event_fd;
+  size_t mapped_size;
+  // kept here, what is in the header can be changed by the other side
+  uint64_t capacity;
+  Header* header;
+  uint8_t* data;
+
+  SharedRing(int memory_fd, int event_fd, bool create, uint64_t capacity)
+      : event_fd(event_fd), capacity(capacity) {
+    if (!create) {
+      struct stat st {};
+      if (fstat(memory_fd, &st) != 0 || (size_t)st.st_size <= data_offset) {
+        throw SharedRingException();
+      }
+      mapped_size = (size_t)st.st_size;
+    } else {
+      mapped_size = data_offset + capacity;
+    }
+    void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memory_fd, 0);
+    if (memory == MAP_FAILED) {
+      throw SharedRingException();
+    }
+    header = static_cast<Header*>(memory);
+    data = static_cast<uint8_t*>(memory) + data_offset;
+    if (create) {
+      new (header) Header{{0}, {0}, {0}, capacity};
+    } else if (header->capacity != mapped_size - data_offset) {
+      throw SharedRingException();
+    } else {
+      this->capacity = mapped_size - data_offset;
+    }
+  }
+
+ public:
+  /**
+   * Creates a new ring, returns it with the descriptors to pass to the
+   * other side (memfd, eventfd - closed by the caller once passed).
+   */
+  static std::pair<std::unique_ptr<SharedRing>, std::pair<int, int>> create(
+      uint64_t capacity) {
+    int memory_fd = memfd_create("robots-ring", MFD_CLOEXEC);
+    if (memory_fd < 0) {
+      throw SharedRingException();
+    }
+    if (ftruncate(memory_fd, (off_t)(data_offset + capacity)) != 0) {
+      close(memory_fd);
+      throw SharedRingException();
+    }
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd < 0) {
+      close(memory_fd);
+      throw SharedRingException();
+    }
+    std::unique_ptr<SharedRing> ring(
+        new SharedRing(memory_fd, dup(event_fd), true, capacity));
+    return {std::move(ring), std::make_pair(memory_fd, event_fd)};
+  }
+
+  /**
+   * Maps a ring created by the other side. Takes over the eventfd,
+   * the memfd can be closed afterwards.
+   */
+  static std::unique_ptr<SharedRing> attach(int memory_fd, int event_fd) {
+    return std::unique_ptr<SharedRing>(
+        new SharedRing(memory_fd, event_fd, false, 0));
+  }
+
+  SharedRing(const SharedRing&) = delete;
+  SharedRing& operator=(const SharedRing&) = delete;
+
+  [[nodiscard]] int get_event_fd() const {
+    return event_fd;
+  }
+
+  /**
+   * Producer: copies as much as there is space for (maybe nothing),
+   * returns how much. A tail the consumer couldn't have written (past head
+   * or more than capacity behind it) throws ConnectionAborted.
+   */
+  size_t write_some(const uint8_t* src, size_t len) {
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    uint64_t tail = header->tail.load(std::memory_order_acquire);
+    if (tail > head || head - tail > capacity) {
+      throw ConnectionAborted();
+    }
+    size_t n = std::min(len, (size_t)(capacity - (head - tail)));
+    size_t offset = head % capacity;
+    size_t first = std::min(n, (size_t)capacity - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, src + first, n - first);
+    header->head.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  /**
+   * Producer: wakes the consumer up if it sleeps.
+   */
+  void notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->consumer_sleeping.load(std::memory_order_relaxed) &&
+        header->consumer_sleeping.exchange(0)) {
+      uint64_t one = 1;
+      [[maybe_unused]] auto res = ::write(event_fd, &one, sizeof(one));
+    }
+  }
+
+  /**
+   * Consumer: appends everything there is to out (at most capacity),
+   * returns how much.
+   */
+  size_t read_all(std::vector<uint8_t>& out) {
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    auto n = (size_t)std::min(head - tail, capacity);
+    size_t offset = tail % capacity;
+    size_t first = std::min(n, (size_t)capacity - offset);
+    out.insert(out.end(), data + offset, data + offset + first);
+    out.insert(out.end(), data, data + (n - first));
+    header->tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  /**
+   * Consumer: to be called before waiting for the eventfd. Returns false
+   * (and doesn't go to sleep) if something came in the meantime.
+   */
+  bool prepare_sleep() {
+    header->consumer_sleeping.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->head.load(std::memory_order_acquire) !=
+        header->tail.load(std::memory_order_relaxed)) {
+      header->consumer_sleeping.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Consumer: resets the eventfd after waking up.
+   */
+  void clear_event() {
+    uint64_t count;
+    [[maybe_unused]] auto res = ::read(event_fd, &count, sizeof(count));
+  }
+
+  ~SharedRing() {
+    munmap(header, mapped_size);
+    close(event_fd);
+  }
+};
+
+/**
+ * Decorator of a connection's send buffer for extension::shared_ring -
+ * everything written goes to the ring instead of the socket.
+ * A full ring is waited on (like a full socket buffer), a consumer that
+ * doesn't read anything for max_full_wait is treated as disconnected.
+ * Reads go to the wrapped buffer untouched.
+ */
+class SharedRingStreamBuffer : public StreamBuffer {
+ private:
+  static constexpr std::chrono::milliseconds max_full_wait{2000};
+  std::unique_ptr<StreamBuffer> inner;
+  std::unique_ptr<SharedRing> ring;
+  std::vector<uint8_t> pending;
+
+ public:
+  SharedRingStreamBuffer(std::unique_ptr<StreamBuffer> inner,
+                         std::unique_ptr<SharedRing> ring)
+      : inner(std::move(inner)), ring(std::move(ring)) {
+  }
+
+  void get_n_bytes(uint8_t n, std::vector<uint8_t>& data) override {
+    inner->get_n_bytes(n, data);
+  }
+
+  void end_receive() override {
+    inner->end_receive();
+  }
+
+  void get() override {
+    inner->get();
+  }
+
+  void reset() override {
+    pending.clear();
+    inner->reset();
+  }
+
+  void write_n_bytes(uint8_t n, std::vector<uint8_t> buffer) override {
+    pending.insert(pending.end(), buffer.begin(), buffer.begin() + n);
+  }
+
+  void write_bytes(const uint8_t* src, size_t n) override {
+    pending.insert(pending.end(), src, src + n);
+  }
+
+  void send() override {
+    size_t sent = 0;
+    auto stalled_since = std::chrono::steady_clock::now();
+    while (sent < pending.size()) {
+      size_t n = ring->write_some(pending.data() + sent, pending.size() - sent);
+      sent += n;
+      ring->notify();
+      if (n != 0) {
+        stalled_since = std::chrono::steady_clock::now();
+      } else if (std::chrono::steady_clock::now() - stalled_since >
+                 max_full_wait) {
+        throw ConnectionAborted();
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    pending.clear();
+  }
+
+  ~SharedRingStreamBuffer() override = default;
+};
+
+/**
+ * Passes descriptors over a unix domain socket (SCM_RIGHTS), with a single
+ * byte of data - the receiver has to read that byte with receive_fds().
+ * Returns false if the socket is broken. The descriptors stay open here.
+ */
+bool send_fds(int sock, const std::vector<int>& fds) {
+  uint8_t byte = 0;
+  iovec iov{&byte, sizeof(byte)};
+  std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+std::vector<int> receive_fds(int sock, size_t count) {
+  uint8_t byte;
+  iovec iov{&byte, sizeof(byte)};
+  std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * count));
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+    throw ConnectionAborted();
+  }
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count)) {
+    throw SharedRingException();
+  }
+  std::vector<int> fds(count);
+  memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+  return fds;
+}
+
+#endif  // __linux__
+
+#endif  // SIK_ZAD2_SHAREDRING_H
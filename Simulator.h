@@ -0,0 +1,320 @@
+#ifndef SIK_ZAD2_SIMULATOR_H
+#define SIK_ZAD2_SIMULATOR_H
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "GameEngine.h"
+#include "Buffer.h"
+#include "ByteStream.h"
+#include "Message.h"
+#include "Randomizer.h"
+#include "ServerState.h"
+
+namespace po = boost::program_options;
+
+class DecodeCheckException : public std::exception {
+  [[nodiscard]] const char *what() const noexcept override {
+    return "A turn did not decode back to what was encoded";
+  }
+};
+
+class ResumeCheckException : public std::exception {
+  [[nodiscard]] const char *what() const noexcept override {
+    return "A resumed client would not get the turns it is missing";
+  }
+};
+
+/**
+ * Command line options of robots-sim. Every combination of a board size
+ * and a players count is a separate scenario. All options have defaults.
+ */
+struct SimCommandLineOpts {
+  std::vector<uint16_t> sizes;
+  std::vector<uint16_t> players_counts;
+  uint16_t game_length{};
+  uint16_t games{};
+  uint16_t bomb_timer{};
+  uint16_t explosion_radius{};
+  uint16_t block_density{};
+  uint32_t seed{};
+  bool check_decode{};
+
+  bool parse_command_line(int argc, char *argv[]) {
+    try {
+      po::options_description desc("Opcje programu");
+      desc.add_options()
+          ("help,h", "produce help message")
+          ("size,x", po::value<std::vector<uint16_t>>(&sizes)->multitoken()
+                   ->default_value({10, 100, 1000}, "10 100 1000"),
+                   "<u16...>, board is size x size")
+          ("players-count,c",
+                   po::value<std::vector<uint16_t>>(&players_counts)
+                   ->multitoken()->default_value({1, 4, 16}, "1 4 16"),
+                   "<u8...>")
+          ("game-length,l",
+                   po::value<uint16_t>(&game_length)->default_value(1000),
+                   "<u16>")
+          ("games,g", po::value<uint16_t>(&games)->default_value(3),
+                   "<u16, games per scenario>")
+          ("bomb-timer,b", po::value<uint16_t>(&bomb_timer)->default_value(5),
+                   "<u16>")
+          ("explosion-radius,e",
+                   po::value<uint16_t>(&explosion_radius)->default_value(3),
+                   "<u16>")
+          ("block-density,k",
+                   po::value<uint16_t>(&block_density)->default_value(10),
+                   "<0-100, initial blocks as percent of the board>")
+          ("seed,s", po::value<uint32_t>(&seed)->default_value(42), "<u32>")
+          ("check-decode",
+                   po::bool_switch(&check_decode)->default_value(false),
+                   "decode every turn (and a full-board Turn 0) as a client "
+                   "would, untimed");
+
+      po::variables_map vm;
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+
+      if (vm.count("help")) {
+        std::cout << desc << "\n";
+        return false;
+      }
+      po::notify(vm);
+    } catch (std::exception &e) {
+      std::cerr << "Error: " << e.what() << "\n";
+      return false;
+    } catch (...) {
+      std::cerr << "Unknown error!"
+                << "\n";
+      return false;
+    }
+
+    for (auto size : sizes) {
+      if (size == 0) {
+        std::cerr << "Size has to be positive\n";
+        return false;
+      }
+    }
+    for (auto count : players_counts) {
+      if (count == 0 || count > UINT8_MAX) {
+        std::cerr << "Players count has to be in range 1-255\n";
+        return false;
+      }
+    }
+    if (block_density > 100) {
+      std::cerr << "Block density is a percent\n";
+      return false;
+    }
+    return true;
+  }
+};
+
+/**
+ * Runs complete games on the GameEngine as fast as possible (no sockets,
+ * no turn timer) and reports how many turns per second the rules can do.
+ * Every player sends a random action each turn, generated by a separate
+ * Randomizer so the games themselves stay deterministic for a given seed.
+ * Only engine calls are timed, input generation is not.
+ * With --check-decode every turn is also encoded (plain and compact) and
+ * decoded with the limits a client of that game uses, and a client resuming
+ * right before and right after Turn 0 is checked to get the turns it lacks.
+ */
+class Simulator {
+ private:
+  using clock = std::chrono::steady_clock;
+
+  const SimCommandLineOpts &opts;
+  std::vector<std::shared_ptr<ClientMessage>> actions;
+
+  struct Result {
+    uint64_t turns{};
+    uint64_t events{};
+    clock::duration elapsed{};
+  };
+
+  [[nodiscard]] ServerCommandLineOpts make_config(uint16_t size,
+                                                  uint8_t players_count) const {
+    ServerCommandLineOpts config;
+    config.bomb_timer = opts.bomb_timer;
+    config.players_count = players_count;
+    config.explosion_radius = opts.explosion_radius;
+    config.initial_blocks = (uint16_t)std::min<uint64_t>(
+        (uint64_t)size * size * opts.block_density / 100, UINT16_MAX);
+    config.game_length = opts.game_length;
+    config.server_name = "robots-sim";
+    config.seed = opts.seed;
+    config.size_x = size;
+    config.size_y = size;
+
+    return config;
+  }
+
+  /**
+   * Encodes the turn and decodes it under DecodeLimits::for_game of the
+   * state's game, throws if it doesn't come back whole.
+   */
+  static void check_round_trip(const ServerState &state, Turn &turn) {
+    DecodeLimits limits = DecodeLimits::for_game(
+        state.get_size_x(), state.get_size_y(), state.get_players_count(),
+        state.get_bomb_timer());
+    for (bool compact : {false, true}) {
+      auto *buffer = new MemoryStreamBuffer();
+      ByteStream stream((std::unique_ptr<StreamBuffer>(buffer)));
+      stream.set_compact(compact);
+      stream.set_limits(limits);
+      turn.serialize(stream);
+      std::vector<uint8_t> encoded = buffer->get_output();
+      buffer->set_input(encoded.data(), encoded.size());
+      auto decoded =
+          std::dynamic_pointer_cast<Turn>(ServerMessage::deserialize(stream));
+      if (!decoded || decoded->get_events_count() != turn.get_events_count() ||
+          buffer->get_read_offset() != encoded.size()) {
+        throw DecodeCheckException();
+      }
+    }
+  }
+
+  /**
+   * The longest Turn 0 there can be: every player moved and a block on
+   * every cell of the board.
+   */
+  static void check_full_board(const ServerState &state) {
+    Turn turn(0);
+    for (PlayerId id = 0; id < state.get_players_count(); ++id) {
+      turn.addEvent(std::make_shared<PlayerMoved>(id, Position(0, 0)));
+    }
+    for (uint16_t x = 0; x < state.get_size_x(); ++x) {
+      for (uint16_t y = 0; y < state.get_size_y(); ++y) {
+        turn.addEvent(std::make_shared<BlockPlaced>(Position(x, y)));
+      }
+    }
+    check_round_trip(state, turn);
+  }
+
+  /**
+   * Index of the first turn the server would send to the client if it
+   * resumed now (its Resume goes through encoding and decoding too).
+   */
+  static std::optional<size_t> resumed_from(const ServerState &state,
+                                            const ClientState &client) {
+    auto *buffer = new MemoryStreamBuffer();
+    ByteStream stream((std::unique_ptr<StreamBuffer>(buffer)));
+    Resume(0, 0, client.next_turn()).serialize(stream);
+    std::vector<uint8_t> encoded = buffer->get_output();
+    buffer->set_input(encoded.data(), encoded.size());
+    auto resume = std::dynamic_pointer_cast<ClientResume>(
+        ClientExtensions::deserialize_first(stream));
+    if (!resume) {
+      throw DecodeCheckException();
+    }
+    return state.resume_from_no_sync(resume->get_next_turn());
+  }
+
+  /**
+   * A connection that dropped after GameStarted, before Turn 0, has to get
+   * Turn 0 back (it has no positions or blocks otherwise), one that dropped
+   * right after it - everything after Turn 0.
+   */
+  static void check_resume(ServerState &state,
+                           const std::shared_ptr<Turn> &first_turn) {
+    state.add_turn_sync(first_turn);
+    ClientState client{};
+    Hello(state).update_client_state(client);
+    GameStarted(state).update_client_state(client);
+    if (resumed_from(state, client) != std::optional<size_t>(0)) {
+      throw ResumeCheckException();
+    }
+    first_turn->update_client_state(client);
+    if (resumed_from(state, client) != std::optional<size_t>(1)) {
+      throw ResumeCheckException();
+    }
+  }
+
+  Result run_scenario(uint16_t size, uint8_t players_count) {
+    ServerState state(make_config(size, players_count));
+    GameEngine engine(state);
+    Randomizer input_rand(opts.seed + 1);
+    std::map<PlayerId, std::shared_ptr<ClientMessage>> inputs;
+    Result res;
+
+    if (opts.check_decode) {
+      check_full_board(state);
+    }
+    for (uint16_t game = 0; game < opts.games; ++game) {
+      for (uint16_t i = 0; i < players_count; ++i) {
+        std::optional<PlayerId> id;
+        state.try_to_join(id, {"bot" + std::to_string(i), "[::1]:0"});
+      }
+      state.start_game();
+
+      auto start = clock::now();
+      auto first_turn = engine.init_game();
+      res.elapsed += clock::now() - start;
+      res.events += first_turn->get_events_count();
+      if (opts.check_decode) {
+        check_round_trip(state, *first_turn);
+        check_resume(state, first_turn);
+      }
+
+      // wider than the turn numbers, -l 65535 would wrap a u16 forever
+      for (uint32_t turn = 1; turn <= opts.game_length; ++turn) {
+        inputs.clear();
+        for (PlayerId id = 0; id < players_count; ++id) {
+          size_t action = input_rand.get_next_val() % (actions.size() + 1);
+          if (action < actions.size()) {
+            inputs[id] = actions[action];
+          }
+        }
+
+        start = clock::now();
+        auto played = engine.play_turn((uint16_t)turn, inputs);
+        res.elapsed += clock::now() - start;
+        res.events += played->get_events_count();
+        if (opts.check_decode) {
+          check_round_trip(state, *played);
+        }
+      }
+      res.turns += opts.game_length + 1;
+      state.reset();
+    }
+
+    return res;
+  }
+
+ public:
+  explicit Simulator(const SimCommandLineOpts &opts) : opts(opts) {
+    for (uint8_t dir = 0; dir < 4; ++dir) {
+      actions.push_back(std::make_shared<ClientMove>(dir));
+    }
+    actions.push_back(std::make_shared<ClientPlaceBomb>());
+    actions.push_back(std::make_shared<ClientPlaceBlock>());
+  }
+
+  void run() {
+    std::printf("%12s %8s %10s %12s %12s %10s\n", "board", "players",
+                "turns", "events/turn", "turns/s", "ns/turn");
+    for (auto size : opts.sizes) {
+      for (auto players_count : opts.players_counts) {
+        Result res = run_scenario(size, (uint8_t)players_count);
+        auto ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      res.elapsed)
+                      .count();
+        std::string board =
+            std::to_string(size) + "x" + std::to_string(size);
+
+        std::printf("%12s %8u %10lu %12.2f %12.0f %10.0f\n", board.c_str(),
+                    (unsigned)players_count, (unsigned long)res.turns,
+                    (double)res.events / (double)res.turns,
+                    (double)res.turns / ns * 1e9, ns / (double)res.turns);
+      }
+    }
+  }
+};
+
+#endif  // SIK_ZAD2_SIMULATOR_H
@@ -0,0 +1,227 @@
+#ifndef SIK_ZAD2_TRACE_H
+#define SIK_ZAD2_TRACE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Timeline of what the server's threads do, exported in Chrome's trace
+ * event format (chrome://tracing, Perfetto). The TRACE_ macros are compiled
+ * in with -DROBOTS_TRACE and record only while tracing is enabled
+ * (robots-server --trace-dir), otherwise they cost a relaxed load each.
+ * Every thread records into its own buffer - a ring of the last
+ * buffer_events events, written without locks. A dump takes what was
+ * recorded since the previous one.
+ */
+namespace trace {
+
+#ifdef ROBOTS_TRACE
+constexpr bool compiled_in = true;
+#else
+constexpr bool compiled_in = false;
+#endif
+
+struct Event {
+  const char* name;  // has to be a literal, it is kept until the dump
+  uint64_t ns;       // since the tracing started
+  char phase;        // 'B' - span begins, 'E' - ends, 'i' - instant
+};
+
+class ThreadBuffer {
+ private:
+  static const size_t buffer_events = 1 << 14;
+  std::array<Event, buffer_events> events;
+  // events ever written, published by the owner with release
+  std::atomic<uint64_t> written{};
+  // events ever taken by dumps, only touched under the registry's mutex
+  uint64_t dumped{};
+
+ public:
+  const uint32_t tid;
+  const char* thread_name = "thread";
+  // the thread is gone, the buffer can be given to a new one once dumped
+  std::atomic<bool> abandoned{};
+
+  explicit ThreadBuffer(uint32_t tid) : events(), tid(tid) {
+  }
+
+  void record(const char* name, uint64_t ns, char phase) {
+    uint64_t index = written.load(std::memory_order_relaxed);
+    events[index % buffer_events] = Event{name, ns, phase};
+    written.store(index + 1, std::memory_order_release);
+  }
+
+  /**
+   * Appends the events written since the last take. Ones overwritten in
+   * the meantime (more than buffer_events) are lost, ones the owner could
+   * be overwriting during the copy are dropped.
+   */
+  void take(std::vector<Event>& out) {
+    uint64_t end = written.load(std::memory_order_acquire);
+    uint64_t begin = std::max(dumped, end > buffer_events ? end - buffer_events
+                                                          : (uint64_t)0);
+    size_t old_size = out.size();
+    for (uint64_t i = begin; i < end; ++i) {
+      out.push_back(events[i % buffer_events]);
+    }
+    // the owner may be writing event now, over now - buffer_events
+    uint64_t safe_from = written.load(std::memory_order_acquire) + 1;
+    safe_from = safe_from > buffer_events ? safe_from - buffer_events : 0;
+    if (safe_from > begin) {
+      auto overwritten = (size_t)(std::min(end, safe_from) - begin);
+      out.erase(out.begin() + (ptrdiff_t)old_size,
+                out.begin() + (ptrdiff_t)(old_size + overwritten));
+    }
+    dumped = end;
+  }
+
+  [[nodiscard]] bool drained() const {
+    return dumped == written.load(std::memory_order_acquire);
+  }
+};
+
+class Registry {
+ private:
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+ public:
+  std::atomic<bool> enabled{};
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  ThreadBuffer* acquire() {
+    std::lock_guard lk(mutex);
+    for (auto& buffer : buffers) {
+      if (buffer->abandoned && buffer->drained()) {
+        buffer->abandoned = false;
+        buffer->thread_name = "thread";
+        return buffer.get();
+      }
+    }
+    auto tid = (uint32_t)buffers.size();
+    buffers.push_back(std::make_unique<ThreadBuffer>(tid));
+    return buffers.back().get();
+  }
+
+  /**
+   * Writes everything recorded since the last dump to path as a JSON
+   * object with traceEvents. Returns false if the file can't be written.
+   */
+  bool dump(const std::string& path) {
+    std::ofstream file(path);
+    if (!file) {
+      return false;
+    }
+    std::lock_guard lk(mutex);
+    file << "{\"traceEvents\":[\n";
+    bool first = true;
+    std::vector<Event> events;
+    for (auto& buffer : buffers) {
+      events.clear();
+      buffer->take(events);
+      file << (first ? "" : ",\n") << R"({"name":"thread_name","ph":"M",)"
+           << R"("pid":1,"tid":)" << buffer->tid << R"(,"args":{"name":")"
+           << buffer->thread_name << "\"}}";
+      first = false;
+      for (auto& event : events) {
+        file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\""
+             << event.phase << "\",\"ts\":" << event.ns / 1000 << '.'
+             << event.ns / 100 % 10 << event.ns / 10 % 10 << event.ns % 10
+             << ",\"pid\":1,\"tid\":" << buffer->tid
+             << (event.phase == 'i' ? ",\"s\":\"t\"}" : "}");
+      }
+    }
+    file << "\n]}\n";
+    return (bool)file;
+  }
+};
+
+inline Registry registry;
+
+/**
+ * The calling thread's buffer, given back to the registry when it exits.
+ */
+inline ThreadBuffer& thread_buffer() {
+  struct Owner {
+    ThreadBuffer* buffer = registry.acquire();
+    ~Owner() {
+      buffer->abandoned = true;
+    }
+  };
+  thread_local Owner owner;
+  return *owner.buffer;
+}
+
+inline bool enabled() {
+  return registry.enabled.load(std::memory_order_relaxed);
+}
+
+inline void record(const char* name, char phase) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - registry.start)
+                .count();
+  thread_buffer().record(name, (uint64_t)ns, phase);
+}
+
+inline void instant(const char* name) {
+  if (enabled()) {
+    record(name, 'i');
+  }
+}
+
+inline void set_thread_name(const char* name) {
+  if (enabled()) {
+    thread_buffer().thread_name = name;
+  }
+}
+
+/**
+ * Begin when constructed, end when destroyed. A span begun while tracing
+ * was enabled is always ended.
+ */
+class Span {
+ private:
+  const char* name;
+  bool active;
+
+ public:
+  explicit Span(const char* name) : name(name), active(enabled()) {
+    if (active) {
+      record(name, 'B');
+    }
+  }
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  ~Span() {
+    if (active) {
+      record(name, 'E');
+    }
+  }
+};
+
+}  // namespace trace
+
+#ifdef ROBOTS_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) trace::Span TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define TRACE_INSTANT(name) trace::instant(name)
+#define TRACE_THREAD(name) trace::set_thread_name(name)
+#else
+#define TRACE_SPAN(name)
+#define TRACE_INSTANT(name)
+#define TRACE_THREAD(name)
+#endif
+
+#endif  // SIK_ZAD2_TRACE_H
@@ -0,0 +1,67 @@
+#include "EngineBenchmark.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "Message.h"
+
+std::atomic<uint64_t> allocations;
+
+// Every allocation is counted. The other forms of new (arrays, nothrow)
+// call these ones. Not inlined, so that gcc doesn't see free() called on
+// what new returned.
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto align = (std::size_t)alignment;
+  size = (size + align - 1) / align * align;
+  if (void *ptr = std::aligned_alloc(align, size == 0 ? align : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(
+    void *ptr, [[maybe_unused]] std::size_t size) noexcept {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(
+    void *ptr, [[maybe_unused]] std::align_val_t alignment) noexcept {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(
+    void *ptr, [[maybe_unused]] std::size_t size,
+    [[maybe_unused]] std::align_val_t alignment) noexcept {
+  std::free(ptr);
+}
+
+int main(int argc, char *argv[]) {
+  BenchCommandLineOpts opts;
+  if (!opts.parse_command_line(argc, argv)) {
+    return 1;
+  }
+  register_all_server();
+
+  try {
+    EngineBenchmark(opts).run();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
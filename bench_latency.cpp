@@ -0,0 +1,19 @@
+#include "LatencyBenchmark.h"
+
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+  LatencyCommandLineOpts opts;
+  if (!opts.parse_command_line(argc, argv)) {
+    return 1;
+  }
+
+  try {
+    LatencyBenchmark(opts).run();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
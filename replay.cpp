@@ -0,0 +1,24 @@
+#include "ReplayPlayer.h"
+
+#include <boost/asio.hpp>
+#include <iostream>
+
+#include "Message.h"
+
+int main(int argc, char *argv[]) {
+  ReplayCommandLineOpts opts;
+  if (!opts.parse_command_line(argc, argv)) {
+    return 1;
+  }
+  register_all_client();
+
+  try {
+    boost::asio::io_context io_context;
+    ReplayPlayer(io_context, opts).run();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
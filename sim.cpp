@@ -0,0 +1,23 @@
+#include "Simulator.h"
+
+#include <iostream>
+
+#include "Message.h"
+
+int main(int argc, char *argv[]) {
+  SimCommandLineOpts opts;
+  if (!opts.parse_command_line(argc, argv)) {
+    return 1;
+  }
+  register_all_server();
+  register_all_client();
+
+  try {
+    Simulator(opts).run();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}